@@ -7,24 +7,41 @@
 //
 //Description:
 //**** This firmware module sets up the functionality for the ARAFE master board to receive communications via I2C or a serial debug port to
-//**** control the ARAFE-PC boards and communicate with them. All communications are stored in registers. These registers are constantly checked
-//**** and action is taken if a control bit in a register is high.
+//**** control the ARAFE-PC boards and communicate with them. All communications are stored in registers. Writing a control bit high
+//**** posts a pending-work flag, and the main loop takes action for every posted flag. In between it sleeps in LPM0.
 //The incoming communications from the serial debug port and I2C are interpreted in the following way:
 //**** byte 1: pointer to register, to which to the following data should be written to.
 //**** byte 2..x: data to be written to the register. If there are several data bytes, the pointer will increment with every written byte.
 //************** NOTE: Only in case of a Slave control communication several bytes need to be written (SLAVECTL, COMMAND, ARG).
+//Reads (I2C only) start at the last pointer written and return consecutive registers, wrapping at the end of the register map
+//like writes do. One read transaction can therefore return the whole register map. The MONx bank is not updated while a
+//read is in progress, so it always comes from one scan.
+//I2C writes take the pointer and up to 31 data bytes. Bytes beyond that are dropped. The I2C interrupt holds SCL low
+//until it has the next byte ready. A read byte is one register copy, but the start condition of a write-then-read
+//first hands the write to receiveEvent(), and with it everything writeRegister() does right away.
+//LATCTL histogram 6 gives the time of the start and stop condition handlers, so the SCL low time at 400kHz can be read
+//off the board.
 //Difference between I2C and Serial debug port:
 //****I2C: data is delimited by standard I2C protocol. NOTE: The pointer and all data must be part of one I2C transfer.
 //****Serial debug port: This is a custom design: Start delimiter "c", end delimiter "!". Everything in between will be treated as one transfer.
 //********************** NOTE: When typing in a serial monitor, the pointer and all data bytes must be put in as 2-digit hexadecimal numbers. 
 //********************** Example: 0x8 has to be typed as 08.
-#define REG_MAX 8
+//****Serial debug port, binary mode: The "bin [baud]" command switches the debug port to SLIP framed binary requests
+//********************** (default 115200 baud). Requests can be sent back to back, each one is answered in order.
+//********************** Request:  seq, op, register, length, [data], CRC16 (low byte first)
+//********************** Response: seq, op | 0x80, status, register, length, [data], CRC16 (low byte first). Data only for reads.
+//********************** op 1: read length registers, op 2: write data to length registers, op 3: back to the command shell.
+//********************** status 0: ok, 1: CRC error, 2: bad register range, 3: unknown op.
+//********************** CRC16 is CCITT (polynomial 0x1021, start value 0xFFFF) over all bytes before it.
+#define REG_MAX 241
 unsigned char currentRegisterPointer = 0;
-unsigned char i2cRegisterMap[REG_MAX] ={0,0,0,0,0,0,0,0};
+unsigned char i2cRegisterMap[REG_MAX];
 //The register map is:
 //***** Register 0: POWERCTL
 //************* Bits [3:0]: indicates which slaves are currently powered on
 //************* Bit [7]: Actually update power based on bits [3:0]. Clear when update is complete.
+//************* NOTE: Slaves go off right away, but are turned on one by one by the power sequencer (see SEQCTL).
+//*************       Bit [7] stays set until the sequence is done. At power on, POWERDFLT is sequenced the same way.
 //***** Register 1: POWERDFLT
 //************* Bits [3:0]: indicates which slaves are currently powered on by default
 //************* Bit [7]: Actually update the non-volatile copy of this register. Clear when update is complete.
@@ -36,20 +53,213 @@ unsigned char i2cRegisterMap[REG_MAX] ={0,0,0,0,0,0,0,0};
 //************* Bits [7:0]: High 8 bits for the conversion
 //***** Register 4: SLAVECTL
 //************* Bits [1:0]: Destination for slave command
-//************* Bit [7]: Actually send the command. Clear when response received or timeout received.
-//************* Bit [6]: Set if command timed out
+//************* Bit [5]: Fan-out: send COMMAND/ARG to every slave set in bits [3:0], one after the other.
+//*************          The results go to FANRES, ACK is left alone.
+//************* Bit [7]: Actually send the command. Stays set while the command is in flight, cleared when response received or timeout received.
+//************* Bit [6]: Set if command timed out. For a fan-out: set if any of the slaves failed.
+//************* NOTE: The slave command runs in the background. All other registers keep being served while bit [7] is set.
 //***** Register 5: COMMAND
 //************* Bits [7:0]: Command to send to slave
 //***** Register 6: ARG
 //************* Bits [7:0]: Argument to send to slave
 //***** Register 7: ACK
-//************* Bits [7:0] Acknowledged value received
+//************* Bits [7:0] Acknowledged value received. For a long response (see RESP), its first data byte.
+//***** Registers 8-23: MON0L, MON0H, ... MON7L, MON7H (read only)
+//************* Latest conversion of monitoring value 0-7, continuously updated in the background. Low byte first.
+//************* MONxL bits [7:0]: Low 8 bits of the conversion
+//************* MONxH bits [1:0]: High 2 bits of the conversion
+//***** Register 24: MONSEQ (read only)
+//************* Bits [7:0]: Incremented every time all MONx registers have been updated.
+//***** Register 25: SNAPCTL
+//************* Bit [7]: Latch a new telemetry snapshot into registers 26-39. Done as soon as it is written, reads back as 0.
+//***** Registers 26-39: SNAPSHOT (read only). One burst read from register 25 returns SNAPCTL and the whole snapshot.
+//************* Registers 26-35: monitoring values 0-7, 10 bits each, packed LSB first (value x is bits [10x+9:10x]).
+//************* Register 36: Bits [3:0] POWERCTL state, Bit [4] FAULT asserted, Bit [7] power update pending
+//************* Register 37: firmware version
+//************* Register 38: board ID
+//************* Register 39: MONSEQ when the snapshot was taken
+//***** Register 40: OSCTL
+//************* Bits [1:0]: Oversampling for monitoring values 0-4 (15V_MON, CUR0-CUR3): 0: off, 1: 4x, 2: 16x, 3: 64x.
+//*************             Each step averages 4 times more conversions and adds one bit to STATVAL. MONx holds the average at 10 bits.
+//*************             The average runs over consecutive scans, so MONx and MONSEQ update once every 4^ratio scans.
+//***** Register 41: STATCTL
+//************* Bits [2:0]: Monitoring value (0-4) to get statistics for
+//************* Bit [7]: Copy the statistics into registers 42-51 and restart them. Clear when STAT registers are updated.
+//***** Registers 42-51: STAT (read only). 16 bit values, low byte first.
+//************* Registers 42-43 STATVAL: latest oversampled value, 10 + OSCTL bits
+//************* Registers 44-45 STATMIN: smallest single conversion since the last STATCTL
+//************* Registers 46-47 STATMAX: largest single conversion since the last STATCTL
+//************* Registers 48-49 STATMEAN: mean of all conversions since the last STATCTL, in 1/64 of a count
+//************* Registers 50-51 STATCNT: number of conversions since the last STATCTL (stops at 65535)
+//************* NOTE: Once STATCNT has stopped, STATMEAN is the mean of the first 65535 conversions. STATMIN and
+//*************       STATMAX keep following every conversion.
+//***** Register 52: TRIPSTAT
+//************* Bits [3:0]: Set when slave x was powered off because CURx went above its threshold
+//************* Bit [4]: Set when all slaves were powered off because !FAULT was asserted
+//************* NOTE: Tripped slaves are also cleared in POWERCTL. Write 0 to clear TRIPSTAT.
+//***** Register 53: TRIPCTL
+//************* Bits [3:0]: Enable the overcurrent trip for slave x
+//************* Bit [4]: Enable the FAULT trip
+//************* Bit [7]: Update the non-volatile copy of TRIPCTL and TRIPTHR. Clear when update is complete.
+//***** Registers 54-61: TRIPTHR0L, TRIPTHR0H, ... TRIPTHR3L, TRIPTHR3H
+//************* Overcurrent threshold for CURx, 10 bits, low byte first. Checked on every single conversion.
+//*************             The ADC interrupt cuts power right after the conversion, one scan after the fault at most (see CLKCTL).
+//***** Register 62: SLAVESTAT (read only)
+//************* Bits [1:0]: Result of the last slave command: 0: ok, 1: timeout, 2: framing error, 3: bad trailer byte
+//************* Bits [6:4]: Number of retries the last slave command took (see RETRY)
+//************* NOTE: SLAVECTL bit [6] is set for any of the errors.
+//***** Register 63: LINKCTL
+//************* Bits [2:0]: Slave UART baud rate: 0: 9600, 1: 19200, 2: 38400, 3: 57600, 4: 115200. A rate above 4 is refused:
+//*************             the rate in use stays, and bits [2:0] show it once applied.
+//************* Bit [6]: With bit [7]: also store LINKCTL, CARRIER, TIMEOUT, RETRY and BACKOFF as power on default.
+//************* Bit [7]: Apply LINKCTL, CARRIER and TIMEOUT. Waits for a slave command in flight. Clear when done.
+//***** Register 64: CARRIER
+//************* Bits [7:0]: CARRIER timer period: the CARRIER runs at SMCLK / (2 * (CARRIER + 1)). Default 1: 4MHz. 0 stops it.
+//***** Register 65: TIMEOUT
+//************* Bits [7:0]: Slave response timeout, in units of 10ms. Default 100: 1s. 0 is taken as 1 (10ms), and reads back as 1
+//*************             once applied.
+//***** Register 66: BATCHCTL
+//************* Bits [3:0]: Number of slave commands in BATCH to run (1-8)
+//************* Bit [6]: Set if any command of the batch failed
+//************* Bit [7]: Run the batch, back to back. Clear when all commands are done.
+//***** Registers 67-90: BATCH
+//************* Up to 8 slave commands, 3 bytes each: slave ([1:0]), command, argument
+//***** Registers 91-106: BATCHRES (read only)
+//************* For each slave command of the last batch, 2 bytes: acknowledged value, then result as in SLAVESTAT
+//************* NOTE: The batch runs like a SLAVECTL command, but leaves SLAVECTL and ACK alone.
+//***** Register 107: LOGCTL
+//************* Bit [7]: Copy event LOGCUR of the event log into LOGENTRY, and advance LOGCUR. Done as soon as it is written.
+//************* Bit [6] (read only): Set if events before LOGCUR were overwritten before they were read. LOGCUR skipped them.
+//************* Bit [5] (read only): Set if there was no new event to copy. LOGENTRY is all zeros then.
+//***** Registers 108-109: LOGCUR
+//************* Number of the next event to read from the log, low byte first.
+//***** Registers 110-111: LOGSEQ (read only)
+//************* Number of events ever written to the log, low byte first. The log holds the last 12 of them.
+//***** Registers 112-117: LOGENTRY (read only)
+//************* Registers 112-113: seconds since power on, low byte first
+//************* Register 114: event type: 1: power on, 2: power change, 3: failed slave command, 4: trip
+//************* Registers 115-117: event data, see LOG_RESET, LOG_POWER, LOG_SLAVE and LOG_TRIP
+//************* NOTE: One burst read from LOGCTL after writing it returns the cursor, LOGSEQ and the event.
+//***** Register 118: LATCTL
+//************* Bits [2:0]: Latency histogram to read: 0: loop() pass, 1: I2C write (receiveEvent), 2: slave command transmit,
+//*************             3: wait for the slave response, 4: slave response parse, 5: monitoring conversion,
+//*************             6: I2C start and stop condition handlers
+//************* Bit [6]: Clear all latency histograms, after the copy if bit [7] is set too. Reads back as 0.
+//************* Bit [7]: Copy histogram [2:0] into registers 119-150. Done as soon as it is written, reads back as 0.
+//***** Registers 119-150: LAT (read only). Durations are in SMCLK cycles.
+//************* Registers 119-122 LATCOUNT: number of durations recorded, low byte first
+//************* Registers 123-126 LATMAX: longest duration, low byte first
+//************* Registers 127-150 LATHIST: 12 bins, 16 bits each, low byte first (stop at 65535).
+//*************             Bin 0: below 16 cycles, bin x: 4^(x+1) to 4^(x+2)-1 cycles, bin 11: 4^12 cycles and up.
+//***** Register 151: SEQCTL
+//************* Bit [0]: After the SEQDLY of a slave, also wait until its CURx has settled to SEQSETTLE or below (up to 1s)
+//************* Bit [7]: Store SEQCTL, SEQORDER, SEQDLY and SEQSETTLE as power on default. Clear when done.
+//***** Register 152: SEQORDER
+//************* Order in which slaves are turned on, 2 bits per step: bits [1:0] first, bits [7:6] last. Default 0xE4: 0, 1, 2, 3.
+//************* NOTE: Slaves missing from SEQORDER are turned on after the others.
+//***** Registers 153-156: SEQDLY0-SEQDLY3
+//************* Bits [7:0]: Time to wait after turning on slave x, before the next step, in units of 10ms. Default 10: 100ms.
+//***** Register 157: SEQSETTLE
+//************* Bits [7:0]: Settle threshold for CURx, high 8 bits of the conversion, like MONITOR.
+//***** Register 158: SEQSTAT (read only)
+//************* Bits [3:0]: Slaves still waiting to be turned on
+//************* Bit [6]: Set if the last sequence stopped because CURx did not settle. The slaves left were not turned on.
+//************* Bit [7]: Set while a power sequence runs
+//***** Register 159: ATTCTL
+//************* Bit [0]: Replay the cached attenuator settings to a slave 1s after it is powered on. Default 1.
+//************* Bit [1]: Skip an attenuator command (0-7) whose argument the slave has acknowledged since it was powered on.
+//*************          SLAVECTL/BATCHCTL complete right away then, with the argument as ACK. Default 1.
+//************* Bit [6]: Clear the attenuator cache. Done as soon as it is written, reads back as 0.
+//************* NOTE: The cache keeps the last acknowledged argument of commands 0-7 (signal and trigger attenuation of
+//*************       channels 0-3) for every slave, in FRAM.
+//***** Register 160: ATTSTAT (read only)
+//************* Bits [3:0]: Slaves waiting for, or in, a replay
+//************* Bits [7:4]: Set if the last replay to slave x failed. It stops at the first failed command.
+//***** Register 161: RETRY
+//************* Bits [2:0]: Number of times a failed slave command is sent again, before it counts as failed. Default 2.
+//************* NOTE: This applies to SLAVECTL, BATCHCTL and the attenuator replay alike.
+//***** Register 162: BACKOFF
+//************* Bits [7:0]: Wait before the first retry, in ms. It doubles for every further retry. Default 5.
+//***** Register 163: LQCTL
+//************* Bits [1:0]: Slave to get link quality counters for
+//************* Bit [6]: With bit [7]: restart the counters of the slave after the copy.
+//************* Bit [7]: Copy the counters into registers 164-173. Done as soon as it is written, reads back as 0.
+//***** Registers 164-173: LQ (read only). 16 bit values, low byte first, counters stop at 65535.
+//************* Registers 164-165 LQTRIES: slave transactions, retries included
+//************* Registers 166-167 LQOK: transactions with a good response
+//************* Registers 168-169 LQTIMEOUT: transactions that timed out
+//************* Registers 170-171 LQFRAMING: transactions with a framing error or a bad trailer byte
+//************* Registers 172-173 LQRTT: round trip time of the last good transaction in us (stops at 65535)
+//***** Registers 174-181: FANRES (read only)
+//************* For each slave of the last fan-out, 2 bytes: acknowledged value, then result as in SLAVESTAT. 0 for slaves left out.
+//***** Register 182: CLKCTL
+//************* Bits [1:0]: Clock profile: 0: DCO 16MHz, MCLK and SMCLK 16MHz (default)
+//*************                            1: low CPU: MCLK 2MHz, SMCLK 16MHz. Slave link and CARRIER as in profile 0.
+//*************                            2: low power: DCO 8MHz, MCLK and SMCLK 1MHz.
+//************* Bit [5] (read only): Set if the last profile asked for could not make the CARRIER frequency. Profile 0 is used then.
+//************* Bit [6]: With bit [7]: also store the profile as power on default.
+//************* Bit [7]: Switch to the profile. Waits for a slave command in flight. Clear when done.
+//************* NOTE: CARRIER stays at the same frequency in every profile, and the UART dividers of the debug port and the slave
+//*************       link are worked out again. At 1MHz SMCLK the CARRIER period (CARRIER + 1) has to be a multiple of 16,
+//*************       and LAT durations are in 1MHz cycles. The ADC slows down with MCLK, so that its interrupt takes about
+//*************       the same share of the CPU: a monitoring scan takes 0.5ms in profile 0, 1.8ms in profile 1, 3.5ms in profile 2.
+//***** Register 183: ADDRCTL
+//************* Bit [0]: Also take writes to the I2C general call address (0)
+//************* Bit [1]: Also take writes to GROUPADDR
+//************* Bit [5] (read only): Set if the last apply was refused: I2CADDR or an enabled GROUPADDR is a reserved address
+//*************          (0x00-0x07, 0x78-0x7F), or they are the same. The addresses in use stay as they were.
+//************* Bit [6]: With bit [7]: also store ADDRCTL, I2CADDR and GROUPADDR as power on default.
+//************* Bit [7]: Apply ADDRCTL, I2CADDR and GROUPADDR, once the bus is idle. Clear when done.
+//***** Register 184: I2CADDR
+//************* Bits [6:0]: I2C address of the board. Default 30.
+//***** Register 185: GROUPADDR
+//************* Bits [6:0]: Group address, shared by the boards to be written at once. Default 31.
+//***** Register 186: BCCOUNT (read only)
+//************* Number of writes taken through the general call or group address, wrapping at 255.
+//************* NOTE: A broadcast write is handled like a write to the own address, so one write starts POWERCTL, SNAPCTL or
+//*************       SLAVECTL on every board at the same time. Each board's results are then read from its own address.
+//*************       Broadcast writes to ADDRCTL, I2CADDR and GROUPADDR are ignored. Reads from the group address return
+//*************       0xFF, which leaves SDA to the other boards. The I2C specification gives general call writes that start
+//*************       with 0x04 or 0x06 a meaning of their own, so use the group address on a bus with devices that know it.
+//***** Register 187: RESPLEN (read only)
+//************* Number of bytes in RESP: the data of the last SLAVECTL command's response. 0 if it failed.
+//***** Registers 188-219: RESP (read only)
+//************* Response mailbox: the data bytes of the last SLAVECTL command's response, the rest is 0. Read it in one burst.
+//************* NOTE: A slave answers either "!S!", the acknowledged value and 0xFF (RESPLEN 1), or with a long response:
+//*************       "!L!", a length byte n (up to 32), n data bytes and 0xFF (RESPLEN n). A longer one is a framing error.
+//*************       Batches and fan-outs leave the mailbox alone.
+//***** Registers 220-235: CAL0L, CAL0H, ... CAL7L, CAL7H (read only)
+//************* Monitoring value 0-7 in engineering units, signed 16 bits, low byte first. Updated with MONx.
+//************* CAL0: 15V_MON in mV, CAL1-CAL4: CUR0-CUR3 in mA, CAL5: !FAULT conversion (not calibrated),
+//************* CAL6: 3.3VCC in mV, CAL7: device temperature in 1/100 degC.
+//************* NOTE: CALx = ((conversion * gain) >> 8) + offset, with the coefficients of value x (see CALCTL). The
+//*************       oversampled values 0-4 keep their extra bits: the shift is 8 + the OSCTL ratio then.
+//*************       The default gain of values 0-4 gives the mV at the ADC input, 1500/1023 mV per count. Store the
+//*************       board's divider and shunt in their coefficients to get 15V_MON and CURx right.
+//*************       CAL7 counts from the device's own 30 degC conversion T30 (TLV) instead of 0:
+//*************       CAL7 = (((conversion - T30) * gain) >> 8) + offset, so its offset is the temperature at T30.
+//*************       The default of CAL6 is for the VCC/2 input, the one of CAL7 is the line through the temperature
+//*************       sensor calibration of the device (30 and 85 degC). Without a usable one (CALCTL bit [4]), T30 is
+//*************       taken as 0 and CAL7 is mV as well.
+//***** Registers 236-237: CALGAIN
+//************* Signed gain in 1/256, low byte first
+//***** Registers 238-239: CALOFS
+//************* Signed offset in engineering units, low byte first
+//***** Register 240: CALCTL
+//************* Bits [2:0]: Monitoring value to get or set the calibration of (not 5)
+//************* Bit [4]: Set if the device has no usable temperature sensor calibration, see CAL7 (read only)
+//************* Bit [5]: With bit [7]: set the value back to its default coefficients, and store them.
+//************* Bit [6]: With bit [7]: store CALGAIN and CALOFS as the coefficients of the value.
+//************* Bit [7]: Copy the coefficients of the value to CALGAIN and CALOFS, after bit [5] or [6]. Clear when done.
+//************* NOTE: CALGAIN, CALOFS and CALCTL can be written in one go. The coefficients are kept in FRAM: once one
+//*************       value has been stored, all are.
 
 //This allows to see some extra communications:
 #define DEBUG_MODE 0
 
-//Slave address for I2C communication:
-int I2C_ADDRESS = 30;
+//Default slave and group address for I2C communication, see I2CADDR and GROUPADDR:
+const int I2C_ADDRESS = 30;
+const int I2C_GROUP = 31;
 
 //Set up pins:
 //CARRIER for UART communication with ARAFE_PC boards
@@ -58,6 +268,23 @@ const int CARRIER = P3_4;
 const int EN[4] = {18,16,32,30};  //{LED1, LED2, LED3, LED4}; for debug
 //Communications select output:
 const int COMMS_SEL[2] = {9,10};
+//Multiplexer setting (COMMS_SEL[1], COMMS_SEL[0]) for every slave:
+const uint8_t commsSelect[4] = {0x2, 0x3, 0x0, 0x1};
+//Comparator_D inputs for the response of every slave, V- and V+:
+const uint16_t commsComparator[4] = {
+  CDIMSEL_3 | CDIPSEL_15,
+  CDIMSEL_5 | CDIPSEL_4,
+  CDIMSEL_7 | CDIPSEL_6,
+  CDIMSEL_9 | CDIPSEL_8
+};
+//Direct port access for EN[] and COMMS_SEL[], looked up once by setupPins(): Energia knows the port and bit of a pin
+//only from its pin tables. The EN pins are grouped by port, so enWrite() switches all slaves on one port with one write.
+volatile uint8_t *enPortOut[4];
+uint8_t enPorts = 0;
+uint8_t enPortIndex[4];
+uint8_t enBit[4];
+volatile uint8_t *selOut[2];
+uint8_t selBit[2];
 //Analog ports for monitoring:
 const int analogPort[8] = { 14, 17, 15, 13, 33, 34, 139, 138};
 //0:    15V_MON
@@ -72,30 +299,415 @@ const int analogPort[8] = { 14, 17, 15, 13, 33, 34, 139, 138};
 //9:    board ID (assigned via serial port only)
 //10-15: unused currently
 
-//Need Wire library for I2C comms.
-#include <Wire.h>
+//The sketch has its own handlers for three interrupt vectors: USCI_B0_VECTOR (I2C on eUSCI_B0, see i2cBegin()),
+//ADC10_VECTOR (the monitoring scan) and TIMER2_B1_VECTOR (the latency timer). The parts of Energia that bring handlers
+//for the first two, the Wire library and analogRead(), are not used. A vector has room for one handler, so a second
+//one fails at link time instead of taking over.
 #include <Cmd.h>
+#include <stddef.h>
+#ifdef TwoWire_h
+#error "I2C runs on eUSCI_B0 without the Wire library, whose USCI_B0_VECTOR handler would clash with i2cInterrupt()"
+#endif
 const char *cmd_banner = ">>> ARAFE-Master Command Interface";
 const char *cmd_prompt = "ARAFE> ";
 const char *cmd_unrecog = "Unknown command.";
 #define FIRMWARE_VERSION 2
 
-//The following structure is set up to store and recall a default start setup:
-//The signature: Is checked on startup, to see if a setup has been stored already. If not, all slaves are kept powered off.
-#define INFO_SIGNATURE 0x03
+//Everything kept over a power cycle lives in the 256 bytes at INFO_BASE, 0x1800-0x18FF of the info FRAM. The device
+//has more info FRAM than that, but the sketch uses only this range:
+//**** 0x1800-0x186F: config records (config_t)
+//**** 0x1870-0x1891: attenuator cache (att_t)
+//**** 0x1892-0x18AF: calibration table (cal_t)
+//**** 0x18B0-0x18FF: event log (log_t)
+//The host simulation (sim/) builds with its own INFO_BASE.
+#ifndef INFO_BASE
+#define INFO_BASE 0x1800
+#endif
+
+//The following structure is set up to store and recall a default start setup. It lives in RAM, and is stored in the
+//config records below with saveConfig() whenever it changes.
 //The is the firmware revision: For now this is just there but ignored.
 #define CUR_REVISION 1
 
 //The info structure:
 typedef struct info_t {
-  unsigned char signature;              //< Indicates if the info structure is up to date.
   unsigned char revision;               //< What board revision this is.
   unsigned char power_default;  //< Holds the default values for the power scheme of the slaves.
   unsigned char serno;
+  unsigned short trip_threshold[4];     //< Overcurrent thresholds for CUR0-CUR3.
+  unsigned char trip_enable;            //< Which trips are enabled, as in TRIPCTL.
+  unsigned char link_baud;              //< Slave link setup, as in LINKCTL, CARRIER and TIMEOUT.
+  unsigned char link_carrier;
+  unsigned char link_timeout;
+  unsigned char seq_ctl;                //< Power sequencer setup, as in SEQCTL, SEQORDER, SEQDLY and SEQSETTLE.
+  unsigned char seq_order;
+  unsigned char seq_delay[4];
+  unsigned char seq_settle;
+  unsigned char link_retry;             //< Slave command retries, as in RETRY and BACKOFF.
+  unsigned char link_backoff;
+  unsigned char clock_profile;          //< Clock profile, as in CLKCTL.
+  unsigned char i2c_ctl;                //< I2C addresses, as in ADDRCTL, I2CADDR and GROUPADDR.
+  unsigned char i2c_address;
+  unsigned char i2c_group;
 } info_t;
 
-//The location to store this in non-volatile memory: The address 0x1800 points to the info section of the memory.
-info_t *my_info = (info_t *) 0x1800;
+//The working copy:
+info_t my_info_ram;
+info_t *my_info = &my_info_ram;
+//Older firmware stored only this, as is, at the start of the sketch's range (0x1800). It is taken over at the first
+//boot without a config record. If nothing was stored at all, all slaves are kept powered off.
+#define LEGACY_SIGNATURE 0x03
+typedef struct legacy_info_t {
+  unsigned char signature;              //< LEGACY_SIGNATURE if the structure was set up.
+  unsigned char revision;
+  unsigned char power_default;
+  unsigned char serno;
+} legacy_info_t;
+legacy_info_t *legacy_info = (legacy_info_t *) (INFO_BASE);
+
+//Config records: info_t is stored as a list of TLVs (type, length, value) in one of two records, A and B, which take
+//turns. saveConfig() always writes the record not in use, and its magic byte last, after the CRC. A reset in the middle
+//of a write leaves the older record valid. At boot the valid record with the higher generation is loaded.
+//Unknown types are skipped, and types missing from a record keep their defaults, so fields can come and go.
+#define CONFIG_MAGIC 0xC5
+#define CONFIG_VERSION 1
+#define CONFIG_TLV_MAX 48
+#define CFG_BOARD 1           //< revision, serno
+#define CFG_POWER 2           //< power_default
+#define CFG_TRIP 3            //< trip_threshold[4], trip_enable
+#define CFG_LINK 4            //< link_baud, link_carrier, link_timeout
+#define CFG_SEQ 5             //< seq_ctl, seq_order, seq_delay[4], seq_settle
+#define CFG_RETRY 6           //< link_retry, link_backoff
+#define CFG_CLOCK 7           //< clock_profile
+#define CFG_I2C 8             //< i2c_ctl, i2c_address, i2c_group
+typedef struct config_t {
+  unsigned char magic;                  //< CONFIG_MAGIC when the record is complete.
+  unsigned char version;                //< Layout of the record, CONFIG_VERSION.
+  unsigned short generation;            //< Incremented on every save.
+  unsigned char length;                 //< TLV bytes used.
+  unsigned char reserved;
+  unsigned char tlv[CONFIG_TLV_MAX];
+  unsigned short crc;                   //< CRC16 (as crc16()) of everything before it.
+} config_t;
+
+//The two records take 0x1800-0x186F.
+config_t *my_config = (config_t *) (INFO_BASE);
+//Record in use, or -1 if none is valid.
+int8_t configSlot = -1;
+
+//Event log: a ring buffer of the last LOG_ENTRIES events, kept in FRAM.
+//Events are 6 bytes: time in seconds since power on, type and 3 bytes of data:
+#define LOG_RESET 1   //< boot count low byte, boot count high byte, reset cause (low byte of SYSRSTIV)
+#define LOG_POWER 2   //< power state before, power state after, source: 0: POWERCTL, 1: POWERDFLT at power on
+#define LOG_SLAVE 3   //< slave | (result << 4), command, round trip time in 4ms units. Failed commands only, LQ counts the rest.
+#define LOG_TRIP 4    //< TRIPSTAT, monitoring value that tripped, its conversion >> 2
+#define LOG_SIGNATURE 0xA5
+#define LOG_ENTRIES 12
+typedef struct log_entry_t {
+  unsigned short time;
+  unsigned char type;
+  unsigned char data[3];
+} log_entry_t;
+
+typedef struct log_t {
+  unsigned char signature;              //< Indicates if the log has been set up.
+  unsigned char next;                   //< Where the next event goes.
+  unsigned short seq;                   //< Number of events ever written.
+  unsigned short boots;                 //< Number of power ons.
+  unsigned short reserved;
+  log_entry_t entry[LOG_ENTRIES];
+} log_t;
+
+//The log takes the last 80 bytes of the sketch's range: 0x18B0-0x18FF.
+log_t *my_log = (log_t *) (INFO_BASE + 0xB0);
+
+//Attenuator cache: the last acknowledged argument of the attenuator commands (0-3 signal, 4-7 trigger attenuation of
+//channels 0-3) of every slave. It is kept in FRAM, and replayed to a slave after it has been powered on.
+//attSynced has a bit for every setting the slave has acknowledged since it was powered on. Only those can be skipped.
+#define ATT_SETTINGS 8
+#define ATT_NONE 0xFF
+#define ATT_SIGNATURE 0x5A
+#define ATT_REPLAY_MS 1000
+typedef struct att_t {
+  unsigned char signature;              //< Indicates if the cache has been set up.
+  unsigned char reserved;
+  unsigned char setting[4][ATT_SETTINGS];       //< ATT_NONE if never acknowledged.
+} att_t;
+
+//The cache takes 0x1870-0x1891, after the config records.
+att_t *my_att = (att_t *) (INFO_BASE + 0x70);
+uint8_t attSynced[4];
+unsigned long attPowerOn[4];
+uint8_t attReplay = 0;
+uint8_t attFailed = 0;
+//Set while a replay command is in flight: the replay to slave attDev is at setting attIndex.
+uint8_t attReplaying = 0;
+uint8_t attDev;
+uint8_t attIndex;
+
+//Calibration to engineering units, see CALx. Monitoring value 5 (!FAULT) is digital and has no coefficients, the
+//others have theirs in the same order in the table: CAL_INDEX() maps a value to its place.
+#define CAL_CHANNELS 7
+#define CAL_FAULT 5
+#define CAL_INDEX(ch) ((ch) < CAL_FAULT ? (ch) : (ch) - 1)
+#define CAL_SIGNATURE 0xC5
+#define CAL_MV 375            //< 1500/1023 mV per count in 1/256: the 1.5V reference
+#define CAL_VCC 751           //< The same for the VCC/2 input
+typedef struct cal_t {
+  unsigned char signature;              //< Indicates if the table has been stored.
+  unsigned char reserved;
+  short gain[CAL_CHANNELS];             //< In 1/256
+  short offset[CAL_CHANNELS];
+} cal_t;
+
+//The table takes 0x1892-0x18AF, between the attenuator cache and the log.
+cal_t *my_cal = (cal_t *) (INFO_BASE + 0x92);
+//The coefficients in use. The monitoring scan works from these, not from FRAM.
+short calGain[CAL_CHANNELS];
+short calOffset[CAL_CHANNELS];
+//ADC10_B calibration in the device TLV: the temperature sensor conversion at 30 degC, then at 85 degC, both with the
+//1.5V reference. The host simulation builds with its own.
+#ifndef TLV_ADC_15T30
+#define TLV_ADC_15T30 0x1A1A
+#endif
+const uint16_t *adcTempCal = (const uint16_t *) (TLV_ADC_15T30);
+#define CAL_TEMP 7
+//The conversion CAL7 counts from: T30 of the TLV, 0 without a usable one.
+uint16_t calTempRef = 0;
+//Which slaves are powered on right now, as in POWERCTL.
+uint8_t powerState = 0;
+
+//Power sequencer: slaves are turned on one at a time from loop(), so their inrush currents on the 15V rail do not add up.
+//**** SEQ_DELAY: the slave turned on last gets its SEQDLY before the next step.
+//**** SEQ_SETTLE: if SEQCTL bit [0] is set, a monitoring scan started after SEQ_DELAY then has to show its CURx at or
+//****             below SEQSETTLE. After SEQ_SETTLE_MS the sequence stops, and the slaves left stay off.
+#define SEQ_IDLE 0
+#define SEQ_DELAY 1
+#define SEQ_SETTLE 2
+#define SEQ_SETTLE_MS 1000
+uint8_t seqState = SEQ_IDLE;
+uint8_t seqPending = 0;
+uint8_t seqStep;
+uint8_t seqDev;
+uint8_t seqMonSeq;
+uint8_t seqBefore;
+uint8_t seqSource;
+unsigned long seqStart;
+
+//Slave communication runs as a state machine, so that loop() never blocks on a slave:
+//**** runComms() selects the slave and queues the "!M!" frame. Energia's UART driver sends it from the TX interrupt.
+//**** serviceComms() is called on every pass of loop() and consumes whatever the RX interrupt has put into the Serial1 buffer.
+//**** COMMS_ECHO: the transmit echo is picked up by the RX line. Bytes are discarded until the whole frame has been seen
+//****             coming back, or the frame's wire time has passed. This replaces the fixed 10ms delay.
+//**** COMMS_WAIT: comparator is switched to the slave and the response is collected until it is complete or times out.
+//**** COMMS_BACKOFF: the response was bad or missing, and the frame is sent again after BACKOFF, up to RETRY times.
+//The link speed, CARRIER and timeout are set up by applyLink() from LINKCTL, CARRIER and TIMEOUT.
+const unsigned long slaveBaudRates[5] = {9600, 19200, 38400, 57600, 115200};
+unsigned long slaveBaud = 9600;
+//Clock profiles, see CLKCTL. Energia's millis() counts watchdog intervals of SMCLK / 8192, which it takes to be 16MHz.
+//So SMCLK is either left at 16MHz, or divided by 16 and the watchdog interval by 16 with it: 1MHz / 512 is the same tick.
+#define CLK_PROFILES 3
+#define CLK_LOWCPU 1
+#define CLK_LOWPOWER 2
+//SMCLK of every profile, as a right shift of 16MHz:
+const uint8_t clockShift[CLK_PROFILES] = {0, 0, 4};
+//ADC clock divider of every profile, for MCLK divided by 8 and 16:
+const uint16_t adcDivider[CLK_PROFILES] = {ADC10DIV_0, ADC10DIV_3, ADC10DIV_7};
+uint16_t clkBootCtl1;
+uint16_t clkBootCtl3;
+uint8_t clkBootWdt;
+uint8_t clockProfile = 0;
+unsigned long slaveTimeoutMs = 1000;
+unsigned long slaveGapMs = 7;
+#define COMMS_FRAME_LENGTH 6
+#define COMMS_IDLE 0
+#define COMMS_ECHO 1
+#define COMMS_WAIT 2
+#define COMMS_BACKOFF 3
+uint8_t commsState = COMMS_IDLE;
+uint8_t commsDev;
+uint8_t commsEcho;
+unsigned long commsStart;
+uint8_t commsFrame[COMMS_FRAME_LENGTH];
+uint8_t commsAck;
+unsigned long commsBegin;
+unsigned long commsSent;
+//Retries of the command in flight so far, and the wait before the next one:
+uint8_t commsTries;
+unsigned long commsBackoff;
+//Link quality counters of every slave, as in LQ:
+#define LINK_TRIES 0
+#define LINK_OK 1
+#define LINK_TIMEOUT 2
+#define LINK_FRAMING 3
+#define LINK_RTT 4
+#define LINK_STATS 5
+uint16_t linkStat[4][LINK_STATS];
+//Set while a BATCHCTL batch runs: the command in flight is batch entry batchIndex.
+uint8_t batchRunning = 0;
+uint8_t batchIndex;
+uint8_t batchCount;
+//Set while a fan-out runs: the command in flight goes to slave fanDev, the next ones to the slaves left in fanMask.
+//The comparator stays on for the whole fan-out, and is switched to the next slave while its frame goes out.
+uint8_t fanRunning = 0;
+uint8_t fanMask;
+uint8_t fanDev;
+uint8_t fanCommand;
+uint8_t fanArg;
+//Background monitoring scan: The ADC converts all analogPort[] channels round robin, driven by its own interrupt.
+//Results go into a back buffer, which is copied to the MONx registers in one go when a full scan is done.
+#define REG_MON_BASE 8
+#define REG_MONSEQ 24
+#define REG_SNAPCTL 25
+#define REG_SNAP_BASE 26
+#define REG_SNAP_END 39
+#define REG_OSCTL 40
+#define REG_STATCTL 41
+#define REG_STAT_BASE 42
+#define REG_STAT_END 51
+#define REG_TRIPSTAT 52
+#define REG_TRIPCTL 53
+#define REG_TRIPTHR_BASE 54
+#define REG_SLAVESTAT 62
+#define REG_LINKCTL 63
+#define REG_CARRIER 64
+#define REG_TIMEOUT 65
+#define REG_BATCHCTL 66
+#define REG_BATCH_BASE 67
+#define REG_BATCHRES_BASE 91
+#define REG_BATCHRES_END 106
+#define BATCH_MAX 8
+#define REG_LOGCTL 107
+#define REG_LOGCUR 108
+#define REG_LOGSEQ 110
+#define REG_LOGENTRY_BASE 112
+#define REG_LOGENTRY_END 117
+#define REG_LATCTL 118
+#define REG_LATCOUNT 119
+#define REG_LATMAX 123
+#define REG_LATHIST_BASE 127
+#define REG_LATHIST_END 150
+#define REG_SEQCTL 151
+#define REG_SEQORDER 152
+#define REG_SEQDLY_BASE 153
+#define REG_SEQSETTLE 157
+#define REG_SEQSTAT 158
+#define REG_ATTCTL 159
+#define REG_ATTSTAT 160
+#define REG_RETRY 161
+#define REG_BACKOFF 162
+#define REG_LQCTL 163
+#define REG_LQ_BASE 164
+#define REG_LQ_END 173
+#define REG_FANRES_BASE 174
+#define REG_FANRES_END 181
+#define REG_CLKCTL 182
+#define REG_ADDRCTL 183
+#define REG_I2CADDR 184
+#define REG_GROUPADDR 185
+#define REG_BCCOUNT 186
+#define REG_RESPLEN 187
+#define REG_RESP_BASE 188
+#define REG_RESP_END 219
+#define REG_CAL_BASE 220
+#define REG_CAL_END 235
+#define REG_CALGAIN 236
+#define REG_CALOFS 238
+#define REG_CALCTL 240
+#define MON_CHANNELS 8
+uint8_t monAdcChannel[MON_CHANNELS];
+uint16_t monScan[MON_CHANNELS];
+uint16_t monLatest[MON_CHANNELS];
+//monLatest in engineering units, see CALx:
+int16_t calLatest[MON_CHANNELS];
+uint8_t monIndex = 0;
+//Oversampling and statistics for the first OS_CHANNELS monitoring values. Their conversions are summed up over
+//4^osRatio scans, so each one is still converted once per scan.
+#define OS_CHANNELS 5
+uint8_t osRatio = 0;
+uint8_t osCount = 0;
+uint32_t osSum[OS_CHANNELS];
+uint16_t osValue[OS_CHANNELS];
+uint32_t statSum[OS_CHANNELS];
+uint16_t statCount[OS_CHANNELS];
+uint16_t statMin[OS_CHANNELS];
+uint16_t statMax[OS_CHANNELS];
+//Trips the ADC interrupt has cut power for, and loop() has not logged yet: bits [3:0] overcurrent of slave x, bit [4]
+//!FAULT. tripValue has the conversion that tripped, by the same bit.
+volatile uint8_t tripPending = 0;
+uint16_t tripValue[5];
+//Analog function select (PxSEL1 and PxSEL0 both set) of ports 1-4, the ones with ADC inputs.
+volatile uint8_t *const adcSel0[4] = {&P1SEL0, &P2SEL0, &P3SEL0, &P4SEL0};
+volatile uint8_t *const adcSel1[4] = {&P1SEL1, &P2SEL1, &P3SEL1, &P4SEL1};
+//Latency histograms of the hot paths, in SMCLK cycles. TB2 runs free on SMCLK, and its overflow interrupt extends it
+//to 32 bits, so even a slave timeout fits. Bins are log4 spaced, see LATHIST.
+#define LAT_LOOP 0
+#define LAT_RECEIVE 1
+#define LAT_SLAVE_TX 2
+#define LAT_SLAVE_WAIT 3
+#define LAT_SLAVE_PARSE 4
+#define LAT_MONITOR 5
+#define LAT_I2C 6
+#define LAT_PATHS 7
+#define LAT_BINS 12
+volatile uint16_t latOverflows = 0;
+uint16_t latHist[LAT_PATHS][LAT_BINS];
+uint32_t latCount[LAT_PATHS];
+uint32_t latMax[LAT_PATHS];
+//Start of the slave transaction phase in flight.
+uint32_t latCommsMark;
+
+//I2C slave state, see i2cInterrupt(). A write is collected in i2cRx[], pointer first. i2cReading is set from the start
+//of a read until the stop condition, and publishMonitoring() leaves the MONx bank alone meanwhile.
+#define I2C_RX_MAX 32
+uint8_t i2cRx[I2C_RX_MAX];
+uint8_t i2cRxLength = 0;
+volatile uint8_t i2cReading = 0;
+uint8_t i2cMonPending = 0;
+uint8_t i2cTxReg;
+//Set for a transaction to the general call or group address.
+uint8_t i2cBroadcast = 0;
+
+//Pending-work flags, posted by writeRegister() when a control bit is written high. One per control register.
+#define WORK_POWERCTL 0x01
+#define WORK_POWERDFLT 0x02
+#define WORK_MONCTL 0x04
+#define WORK_SLAVECTL 0x08
+#define WORK_STATCTL 0x10
+#define WORK_TRIPCTL 0x20
+#define WORK_LINKCTL 0x40
+#define WORK_BATCHCTL 0x80
+#define WORK_SEQCTL 0x100
+#define WORK_CLKCTL 0x200
+#define WORK_ADDRCTL 0x400
+#define WORK_CALCTL 0x800
+volatile uint16_t pendingWork = 0;
+//Energia's interrupt handlers leave LPM on exit when this is cleared by wakeup().
+extern volatile boolean stay_asleep;
+//Critical section that can also be used from the I2C interrupt, where interrupts are off and have to stay off.
+//Everything writeRegister() calls runs in that interrupt, so it has to use this: noInterrupts()/interrupts() would
+//turn interrupts back on inside the handler.
+#define ENTER_CRITICAL() unsigned short savedSR = __get_SR_register(); __disable_interrupt()
+#define EXIT_CRITICAL() if (savedSR & GIE) __enable_interrupt()
+//The slave response is "!S!", the acknowledged value and a trailer byte, or the long response: "!L!", a length byte, that
+//many data bytes and the trailer byte. The parser syncs on the header and fails as soon as the response cannot be right
+//anymore, instead of waiting for the full timeout:
+//**** Up to SLAVE_SYNC_MAX noise bytes are skipped before the first '!'. A wrong header byte after that is a framing error.
+//**** Once the response has started, a gap of more than 5 characters (slaveGapMs) between bytes counts as a timeout.
+//**** The trailer byte has to be SLAVE_TRAILER. The protocol has no checksum, so this is the only check on the payload.
+#define RESP_MAX 32
+const int expectedBytes_UART = 5;
+char c[4 + RESP_MAX + 1];
+int nReceived = 0;
+int nExpected = expectedBytes_UART;
+uint8_t nSkipped = 0;
+unsigned long commsLastByte;
+#define SLAVE_SYNC_MAX 4
+#define SLAVE_TRAILER 0xFF
+#define SLAVE_OK 0
+#define SLAVE_ERR_TIMEOUT 1
+#define SLAVE_ERR_FRAMING 2
+#define SLAVE_ERR_TRAILER 3
 
 void enableXtal() {
 }
@@ -103,39 +715,73 @@ void enableXtal() {
 
 void setup()
 {
+  uint8_t i;
+
+  //Keep the clock setup Energia made, clock profile 0 goes back to it:
+  clkBootCtl1 = CSCTL1;
+  clkBootCtl3 = CSCTL3;
+  clkBootWdt = WDTCTL & 0xff;
 
   //This is the power control part. Always start with power off:
-  digitalWrite(EN[0], LOW);
-  digitalWrite(EN[1], LOW);
-  digitalWrite(EN[2], LOW);
-  digitalWrite(EN[3], LOW);
+  setupPins();
+  enWrite(0xf, 0);
   pinMode(EN[0], OUTPUT);
   pinMode(EN[1], OUTPUT);
   pinMode(EN[2], OUTPUT);
   pinMode(EN[3], OUTPUT);
   
   
-  // Have the default power values ever been programmed? If not, set it up.
-  if (my_info->signature != INFO_SIGNATURE) {
-    my_info->revision = CUR_REVISION;
-    
-    my_info->power_default = 0x0;   //All power off.
-    // when done, set the signature
-   my_info->signature = INFO_SIGNATURE;
-  }
+  // Load the stored setup, or take it over from older firmware.
+  loadConfig();
   //Write values to default power register:
   i2cRegisterMap[1] = my_info->power_default;
+  //And the stored trip setup:
+  i2cRegisterMap[REG_TRIPCTL] = my_info->trip_enable;
+  for (i=0;i<4;i++) {
+    i2cRegisterMap[REG_TRIPTHR_BASE + 2*i] = my_info->trip_threshold[i] & 0xff;
+    i2cRegisterMap[REG_TRIPTHR_BASE + 2*i + 1] = my_info->trip_threshold[i] >> 8;
+  }
+  //And the stored slave link setup:
+  i2cRegisterMap[REG_LINKCTL] = my_info->link_baud;
+  i2cRegisterMap[REG_CARRIER] = my_info->link_carrier;
+  i2cRegisterMap[REG_TIMEOUT] = my_info->link_timeout;
+  i2cRegisterMap[REG_RETRY] = my_info->link_retry;
+  i2cRegisterMap[REG_BACKOFF] = my_info->link_backoff;
+  //And the stored power sequencer setup:
+  i2cRegisterMap[REG_SEQCTL] = my_info->seq_ctl;
+  i2cRegisterMap[REG_SEQORDER] = my_info->seq_order;
+  for (i=0;i<4;i++) i2cRegisterMap[REG_SEQDLY_BASE + i] = my_info->seq_delay[i];
+  i2cRegisterMap[REG_SEQSETTLE] = my_info->seq_settle;
+  //And the stored I2C addresses:
+  i2cRegisterMap[REG_ADDRCTL] = my_info->i2c_ctl;
+  i2cRegisterMap[REG_I2CADDR] = my_info->i2c_address;
+  i2cRegisterMap[REG_GROUPADDR] = my_info->i2c_group;
   
-  //Actually set this up:
-  power(0x0, (i2cRegisterMap[1] >> 0 ) &  0x1);
-  power(0x1, (i2cRegisterMap[1] >> 1 ) &  0x1);
-  power(0x2, (i2cRegisterMap[1] >> 2 ) &  0x1);
-  power(0x3, (i2cRegisterMap[1] >> 3 ) &  0x1);
+  //Set up the attenuator cache, if it never was:
+  if (my_att->signature != ATT_SIGNATURE) {
+    attClear();
+    my_att->signature = ATT_SIGNATURE;
+  }
+  i2cRegisterMap[REG_ATTCTL] = 0x3;
+
+  //The stored calibration, or the defaults if there is none:
+  calLoad();
+
+  //Start the event log, if it was never set up, and log this power on:
+  if (my_log->signature != LOG_SIGNATURE) {
+    memset(my_log, 0, sizeof(log_t));
+    my_log->signature = LOG_SIGNATURE;
+  }
+  my_log->boots++;
+  logEvent(LOG_RESET, my_log->boots & 0xff, my_log->boots >> 8, SYSRSTIV & 0xff);
+  i2cRegisterMap[REG_LOGSEQ] = my_log->seq & 0xff;
+  i2cRegisterMap[REG_LOGSEQ + 1] = my_log->seq >> 8;
+
+  //Actually set this up. The sequencer turns the slaves on from loop(), POWERCTL shows the update in progress meanwhile:
+  i2cRegisterMap[0] = i2cRegisterMap[1] | 0x80;
+  powerSequence(i2cRegisterMap[1], 1);
   
   
-  //Divide SMCLK speed by 2 --> 8MHz. Not executed!!
-  //CSCTL3 |= (1u << 4);
-    
   //Set up 4MHz clock on P3.4 as CARRIER signal:
   //**** Use timer-B. Set it up with no clock divider and in Toggle mode. The maximum frequency achievable in this way is 4MHz. 
   //**** For higher frequencies, mode needs to be set to up or down.
@@ -165,15 +811,16 @@ void setup()
   TB1CCTL1 &= (0u << 8); 
   //Set outmod to Toggle:
   TB1CCTL1 |= (100u << 5);  
-  //Set compare number:
-  TB1CCR0 |= (0x1);
+  //Set compare number (the stored CARRIER setting, 1 by default):
+  TB1CCR0 = i2cRegisterMap[REG_CARRIER];
 
   //Clear setup again: Probably not needed.
   TB1CTL |= (1u << 2);
   //Set timer to up mode (this starts the counter):
   TB1CTL |= (01u << 4);
 
-
+  //Start the free running timer for the latency histograms:
+  setupLatency();
 
   //Make PJ.4, 5 I/O ports. Could move this to the pin-definition file.
   PJSEL0 &= ~(1u << 4);
@@ -182,8 +829,7 @@ void setup()
   PJSEL1 &= ~(1u << 5);
 
   //These two pins control the multiplexer for the communcations bus to the slave devices.
-  digitalWrite(COMMS_SEL[0], LOW);
-  digitalWrite(COMMS_SEL[1], LOW);
+  write_comms_sel(0);
   pinMode(COMMS_SEL[0], OUTPUT);
   pinMode(COMMS_SEL[1], OUTPUT);
 
@@ -192,10 +838,12 @@ void setup()
   P3SEL0 |= (1u << 5);
   P3SEL1 |= (1u << 5);
 
-  //Setup I2C connection
-  Wire.begin(I2C_ADDRESS);       // join i2c bus with address given above.
-  Wire.onReceive(receiveEvent);  // register write from I2C master
-  Wire.onRequest(requestEvent);  // register read request from I2C master
+  //Setup I2C connection, with the stored addresses, or the defaults if they cannot be used:
+  if (!i2cBegin()) {
+    i2cRegisterMap[REG_ADDRCTL] = 0x20;
+    i2cRegisterMap[REG_I2CADDR] = I2C_ADDRESS;
+    i2cBegin();
+  }
 
 
   //Setup serial connections: Baudrate is 9600.
@@ -205,10 +853,142 @@ void setup()
   cmdAdd("sn", cmdAssign);
   cmdAdd("d", cmdDump);
   cmdAdd("help", cmdHelp);
-  Serial1.begin(9600);           // start serial for slave communication.
-  Serial1.setTimeout(1000);      //Serial redBytes will timeout after 1000ms (this is only for information. The default is 1000ms anyway).
+  cmdAdd("bin", cmdBinary);
+  applyLink();                   // start serial for slave communication.
+  //Switch to the stored clock profile. This also sets up the CARRIER and the UART dividers again.
+  applyClock(my_info->clock_profile);
   
-  analogReference(INTERNAL1V5); //set the analog reference
+  setupMonitoring();
+}
+
+// Set up info_t with the defaults, for the fields a config record does not have.
+void infoDefaults(){
+  uint8_t i;
+  my_info->revision = CUR_REVISION;
+  my_info->power_default = 0x0;       //All power off.
+  my_info->serno = 0;
+  my_info->trip_enable = 0x0;         //No trips. Thresholds at full scale.
+  for (i=0;i<4;i++) my_info->trip_threshold[i] = 0x3ff;
+  my_info->link_baud = 0;             //9600 baud, 4MHz CARRIER, 1s timeout.
+  my_info->link_carrier = 1;
+  my_info->link_timeout = 100;
+  my_info->seq_ctl = 0x0;             //Slaves 0-3 in order, 100ms apart, no settle check.
+  my_info->seq_order = 0xE4;
+  for (i=0;i<4;i++) my_info->seq_delay[i] = 10;
+  my_info->seq_settle = 0xff;
+  my_info->link_retry = 2;            //2 retries, 5ms and 10ms later.
+  my_info->link_backoff = 5;
+  my_info->clock_profile = 0;         //Full speed.
+  my_info->i2c_ctl = 0;               //Address 30, group address 31 but off.
+  my_info->i2c_address = I2C_ADDRESS;
+  my_info->i2c_group = I2C_GROUP;
+}
+
+//The config functions take void pointers: Energia puts the function prototypes before the typedefs.
+uint16_t configCrc(const void *rec){
+  uint16_t crc = 0xFFFF;
+  const uint8_t *p = (const uint8_t *) rec;
+  uint8_t i;
+  for (i=0;i<offsetof(config_t, crc);i++) crc = crc16(crc, p[i]);
+  return crc;
+}
+
+uint8_t configValid(const void *record){
+  const config_t *rec = (const config_t *) record;
+  return rec->magic == CONFIG_MAGIC && rec->version == CONFIG_VERSION && rec->length <= CONFIG_TLV_MAX &&
+    rec->crc == configCrc(rec);
+}
+
+//Copy a TLV into the field at dest. Shorter or longer values than the field are taken as far as they go.
+void configGet(uint8_t *tlv, void *dest, uint8_t size){
+  memcpy(dest, &tlv[2], tlv[1] < size ? tlv[1] : size);
+}
+
+//Pick the newest valid config record, and load it. Without one, take over an info structure from older firmware,
+//and store it as a config record right away.
+void loadConfig(){
+  uint8_t valid0 = configValid(&my_config[0]);
+  uint8_t valid1 = configValid(&my_config[1]);
+  config_t *rec;
+  uint8_t *tlv;
+  uint8_t *end;
+
+  if (valid0 && valid1) configSlot = ((int16_t)(my_config[1].generation - my_config[0].generation) > 0) ? 1 : 0;
+  else if (valid0) configSlot = 0;
+  else if (valid1) configSlot = 1;
+  else {
+    configSlot = -1;
+    infoDefaults();
+    if (legacy_info->signature == LEGACY_SIGNATURE) {
+      my_info->revision = legacy_info->revision;
+      my_info->power_default = legacy_info->power_default;
+      my_info->serno = legacy_info->serno;
+    }
+    saveConfig();
+    return;
+  }
+
+  infoDefaults();
+  rec = &my_config[configSlot];
+  tlv = rec->tlv;
+  end = rec->tlv + rec->length;
+  while (tlv + 2 <= end && tlv + 2 + tlv[1] <= end) {
+    if (tlv[0] == CFG_BOARD) {
+      uint8_t board[2];
+      configGet(tlv, board, 2);
+      my_info->revision = board[0];
+      my_info->serno = board[1];
+    }
+    else if (tlv[0] == CFG_POWER) configGet(tlv, &my_info->power_default, 1);
+    else if (tlv[0] == CFG_TRIP) configGet(tlv, &my_info->trip_threshold, 9);
+    else if (tlv[0] == CFG_LINK) configGet(tlv, &my_info->link_baud, 3);
+    else if (tlv[0] == CFG_SEQ) configGet(tlv, &my_info->seq_ctl, 7);
+    else if (tlv[0] == CFG_RETRY) configGet(tlv, &my_info->link_retry, 2);
+    else if (tlv[0] == CFG_CLOCK) configGet(tlv, &my_info->clock_profile, 1);
+    else if (tlv[0] == CFG_I2C) configGet(tlv, &my_info->i2c_ctl, 3);
+    tlv += 2 + tlv[1];
+  }
+}
+
+//Append a TLV to the record.
+void configPut(void *record, uint8_t type, const void *val, uint8_t size){
+  config_t *rec = (config_t *) record;
+  rec->tlv[rec->length] = type;
+  rec->tlv[rec->length + 1] = size;
+  memcpy(&rec->tlv[rec->length + 2], val, size);
+  rec->length += 2 + size;
+}
+
+//Store info_t into the record not in use, and switch over to it.
+void saveConfig(){
+  config_t rec;
+  uint8_t board[2];
+  //Without a valid record, B goes first: A still holds the info structure of older firmware.
+  int8_t slot = (configSlot == 1) ? 0 : 1;
+  config_t *dest = &my_config[slot];
+
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = CONFIG_MAGIC;
+  rec.version = CONFIG_VERSION;
+  rec.generation = (configSlot < 0) ? 1 : my_config[configSlot].generation + 1;
+  board[0] = my_info->revision;
+  board[1] = my_info->serno;
+  configPut(&rec, CFG_BOARD, board, 2);
+  configPut(&rec, CFG_POWER, &my_info->power_default, 1);
+  //trip_threshold[4] and trip_enable are next to each other in info_t.
+  configPut(&rec, CFG_TRIP, &my_info->trip_threshold, 9);
+  configPut(&rec, CFG_LINK, &my_info->link_baud, 3);
+  configPut(&rec, CFG_SEQ, &my_info->seq_ctl, 7);
+  configPut(&rec, CFG_RETRY, &my_info->link_retry, 2);
+  configPut(&rec, CFG_CLOCK, &my_info->clock_profile, 1);
+  configPut(&rec, CFG_I2C, &my_info->i2c_ctl, 3);
+  rec.crc = configCrc(&rec);
+
+  //Invalidate the record first, and complete it last.
+  dest->magic = 0;
+  memcpy((uint8_t *) dest + 1, (uint8_t *) &rec + 1, sizeof(rec) - 1);
+  dest->magic = CONFIG_MAGIC;
+  configSlot = slot;
 }
 
 int cmdAssign(int argc, char **argv) {
@@ -222,6 +1002,7 @@ int cmdAssign(int argc, char **argv) {
   serno = strtoul(*argv, NULL, 0);
   if (serno < 256) {
     my_info->serno = serno;
+    saveConfig();
   } else {
     Serial.println("serial number must be 8 bits (less than 256)");
   }
@@ -236,6 +1017,7 @@ int cmdHelp(int argc, char **argv) {
     Serial.println("w: w [register number] [value] - write value to register");
     Serial.println("sn: sn [serial number] - assign serial number");
     Serial.println("d: d - print all registers");
+    Serial.println("bin: bin [baud] - switch to binary mode at 9600-115200 baud (default 115200)");
     Serial.println("help: help [regs|mons] - prints help. help regs/help mons gives more info.");
   } else {
     if (!strcmp(*argv, "regs")) {
@@ -244,10 +1026,56 @@ int cmdHelp(int argc, char **argv) {
       Serial.println("1   [DFLTCTL]: [3:0] slaves which come on automatically at power on");
       Serial.println("2    [MONCTL]: [3:0] mon value to convert, [5:4] low 2 bits of conversion");
       Serial.println("3   [MONITOR]: [7:0] high 8 bits of conversion");
-      Serial.println("4  [SLAVECTL]: [1:0] slave to address, [6]: set if command timed out");
+      Serial.println("4  [SLAVECTL]: [1:0] slave to address, [5] fan-out to slaves [3:0], [6]: set if command timed out");
       Serial.println("5   [COMMAND]: command to send slave");
       Serial.println("6       [ARG]: argument to send slave");
       Serial.println("7       [ACK]: returned byte from slave");
+      Serial.println("8-23   [MONx]: latest conversion of mon value x, low byte first (read only)");
+      Serial.println("24   [MONSEQ]: incremented when all MONx are updated (read only)");
+      Serial.println("25  [SNAPCTL]: [7] latch telemetry snapshot");
+      Serial.println("26-39  [SNAP]: packed mon values, power/fault, version, board ID, MONSEQ (read only)");
+      Serial.println("40    [OSCTL]: [1:0] oversampling of mon values 0-4: 1x, 4x, 16x, 64x");
+      Serial.println("41  [STATCTL]: [2:0] mon value (0-4) to get statistics for");
+      Serial.println("42-51  [STAT]: oversampled value, min, max, mean (1/64), count (read only)");
+      Serial.println("52 [TRIPSTAT]: [3:0] slaves tripped on overcurrent, [4] all tripped on FAULT. write 0 to clear");
+      Serial.println("53  [TRIPCTL]: [3:0] enable overcurrent trip, [4] enable FAULT trip, [7] store as default");
+      Serial.println("54-61 [TRIPTHR]: overcurrent threshold for CURx, low byte first");
+      Serial.println("62 [SLAVESTAT]: [1:0] last slave command: 0 ok, 1 timeout, 2 framing, 3 bad trailer, [6:4] retries (read only)");
+      Serial.println("63  [LINKCTL]: [2:0] baud 9600/19200/38400/57600/115200, [6] store as default, [7] apply");
+      Serial.println("64  [CARRIER]: CARRIER = SMCLK / (2 * (CARRIER + 1))");
+      Serial.println("65  [TIMEOUT]: slave response timeout in 10ms, 0 is taken as 1");
+      Serial.println("66 [BATCHCTL]: [3:0] number of BATCH commands, [6] set if one failed, [7] run batch");
+      Serial.println("67-90 [BATCH]: 8 x slave, command, argument");
+      Serial.println("91-106 [BATCHRES]: 8 x acknowledged value, result (read only)");
+      Serial.println("107  [LOGCTL]: [7] copy event LOGCUR to LOGENTRY, [6] events were lost, [5] no new event");
+      Serial.println("108-109 [LOGCUR]: next event to read");
+      Serial.println("110-111 [LOGSEQ]: number of events written (read only)");
+      Serial.println("112-117 [LOGENTRY]: seconds, type, 3 bytes data (read only)");
+      Serial.println("118   [LATCTL]: [2:0] histogram: loop/i2c/slave tx/slave wait/slave parse/mon/i2c isr, [6] clear all, [7] copy");
+      Serial.println("119-150  [LAT]: count, max, 12 x log4 bins, in SMCLK cycles (read only)");
+      Serial.println("151  [SEQCTL]: [0] wait for CURx to settle before the next slave, [7] store as default");
+      Serial.println("152 [SEQORDER]: power on order, 2 bits per slave, first in [1:0]");
+      Serial.println("153-156 [SEQDLY]: wait after turning on slave x, in 10ms");
+      Serial.println("157 [SEQSETTLE]: CURx settle threshold, high 8 bits");
+      Serial.println("158 [SEQSTAT]: [3:0] slaves left to turn on, [6] stopped: CURx did not settle, [7] running (read only)");
+      Serial.println("159  [ATTCTL]: [0] replay attenuator cache at power on, [1] skip cached settings, [6] clear cache");
+      Serial.println("160 [ATTSTAT]: [3:0] slaves waiting for replay, [7:4] replay failed (read only)");
+      Serial.println("161   [RETRY]: [2:0] retries of a failed slave command");
+      Serial.println("162 [BACKOFF]: wait before the first retry in ms, doubles for every retry");
+      Serial.println("163   [LQCTL]: [1:0] slave, [6] restart counters, [7] copy link quality counters");
+      Serial.println("164-173  [LQ]: tries, ok, timeouts, framing errors, last round trip in us (read only)");
+      Serial.println("174-181 [FANRES]: 4 x acknowledged value, result of the last fan-out (read only)");
+      Serial.println("182  [CLKCTL]: [1:0] clock profile: 16MHz/low CPU/low power, [5] CARRIER not possible (read only), [6] store as default, [7] apply");
+      Serial.println("183 [ADDRCTL]: [0] take general call writes, [1] take GROUPADDR writes, [5] bad address (read only), [6] store as default, [7] apply");
+      Serial.println("184 [I2CADDR]: I2C address, 7 bits");
+      Serial.println("185 [GROUPADDR]: group address for broadcast writes, 7 bits");
+      Serial.println("186 [BCCOUNT]: broadcast writes taken (read only)");
+      Serial.println("187 [RESPLEN]: bytes in RESP (read only)");
+      Serial.println("188-219 [RESP]: data of the last SLAVECTL response, up to 32 bytes (read only)");
+      Serial.println("220-235 [CALx]: mon value x in mV/mA/0.01 degC, signed, low byte first (read only)");
+      Serial.println("236-237 [CALGAIN]: gain in 1/256, signed, low byte first");
+      Serial.println("238-239 [CALOFS]: offset, signed, low byte first");
+      Serial.println("240  [CALCTL]: [2:0] mon value, [4] no device temperature calibration (read only), [5] back to default, [6] store CALGAIN/CALOFS, [7] copy to CALGAIN/CALOFS, clear when done");
     } else if (!strcmp(*argv, "mons")) {
       Serial.println("0: 15V_MON");
       Serial.println("1: CUR0");
@@ -303,12 +1131,14 @@ int cmdWrite(int argc, char **argv) {
   }
   reg = strtoul(argv[0], NULL, 0);
   val = strtoul(argv[1], NULL, 0);
-  if (reg < REG_MAX) {
+  if (reg < REG_MAX && regWritable(reg)) {
     if (val < 256) {
-      i2cRegisterMap[reg] = val;
+      writeRegister(reg, val);
     } else {
       Serial.println("value must be 8 bits (less than 256)");
     }
+  } else if (reg < REG_MAX) {
+    Serial.println("register is read only");
   } else {
     Serial.println("register must be less than ");
     Serial.println(REG_MAX, DEC);
@@ -316,11 +1146,169 @@ int cmdWrite(int argc, char **argv) {
   return 0;
 }
 
+//Binary mode of the debug port. Frames are SLIP encoded, see the top of this file.
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+#define BIN_OP_READ 1
+#define BIN_OP_WRITE 2
+#define BIN_OP_EXIT 3
+#define BIN_OK 0
+#define BIN_ERR_CRC 1
+#define BIN_ERR_RANGE 2
+#define BIN_ERR_OP 3
+#define BIN_DATA_MAX 64
+#define BIN_FRAME_MAX (BIN_DATA_MAX + 6)
+uint8_t serialBinary = 0;
+//Baud rate of the debug port, for the UART dividers of the clock profile.
+unsigned long debugBaud = 9600;
+uint8_t binFrame[BIN_FRAME_MAX];
+uint8_t binLength = 0;
+uint8_t binEscape = 0;
+uint8_t binOverflow = 0;
+uint16_t binCrc;
+
+int cmdBinary(int argc, char **argv) {
+  unsigned long baud = 115200;
+  uint8_t i;
+  argc--;
+  argv++;
+  if (argc) baud = strtoul(*argv, NULL, 0);
+  //Only the rates uartClock() has dividers for in every clock profile. Anything else stays in text mode.
+  for (i=0;i<5 && slaveBaudRates[i] != baud;i++);
+  if (i == 5) {
+    Serial.println("Usage: bin [baud], baud 9600, 19200, 38400, 57600 or 115200");
+    return 0;
+  }
+  Serial.print("binary mode at ");
+  Serial.println(baud, DEC);
+  Serial.flush();
+  Serial.begin(baud);
+  debugBaud = baud;
+  //Dividers for the clock profile in use. uartClock() keeps the receive interrupt begin() has turned on.
+  uartClock(0, debugBaud);
+  binLength = 0;
+  binEscape = 0;
+  binOverflow = 0;
+  serialBinary = 1;
+  return 0;
+}
+
+uint16_t crc16(uint16_t crc, uint8_t data){
+  uint8_t i;
+  crc ^= (uint16_t) data << 8;
+  for (i=0;i<8;i++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  return crc;
+}
+
+//Collect SLIP frames from the debug port, and handle each one as soon as it is complete.
+void binPoll(){
+  int b;
+  while ((b = Serial.read()) >= 0) {
+    if (b == SLIP_END) {
+      if (binLength && !binOverflow) binHandle();
+      binLength = 0;
+      binEscape = 0;
+      binOverflow = 0;
+      continue;
+    }
+    if (b == SLIP_ESC) {
+      binEscape = 1;
+      continue;
+    }
+    if (binEscape) {
+      b = (b == SLIP_ESC_END) ? SLIP_END : SLIP_ESC;
+      binEscape = 0;
+    }
+    if (binLength < BIN_FRAME_MAX) binFrame[binLength++] = b;
+    else binOverflow = 1;
+  }
+}
+
+void binHandle(){
+  uint8_t seq, op, reg, len, status, i;
+  uint16_t crc = 0xFFFF;
+  if (binLength < 6) return;
+  for (i=0;i<binLength-2;i++) crc = crc16(crc, binFrame[i]);
+  seq = binFrame[0];
+  op = binFrame[1];
+  reg = binFrame[2];
+  len = binFrame[3];
+  status = BIN_OK;
+  if (crc != (binFrame[binLength-2] | (binFrame[binLength-1] << 8))) status = BIN_ERR_CRC;
+  else if (op == BIN_OP_READ) {
+    if (len > BIN_DATA_MAX || reg + len > REG_MAX || binLength != 6) status = BIN_ERR_RANGE;
+  }
+  else if (op == BIN_OP_WRITE) {
+    if (reg + len > REG_MAX || binLength != 6 + len) status = BIN_ERR_RANGE;
+    else for (i=0;i<len;i++) writeRegister(reg + i, binFrame[4 + i]);
+  }
+  else if (op != BIN_OP_EXIT) status = BIN_ERR_OP;
+
+  binStart();
+  binPut(seq);
+  binPut(op | 0x80);
+  binPut(status);
+  binPut(reg);
+  if (status == BIN_OK && op == BIN_OP_READ) {
+    binPut(len);
+    //Same as an I2C burst read: copied with interrupts off, so the block is consistent.
+    noInterrupts();
+    memcpy(binFrame, &i2cRegisterMap[reg], len);
+    interrupts();
+    for (i=0;i<len;i++) binPut(binFrame[i]);
+  } else {
+    binPut(0);
+  }
+  binEnd();
+
+  if (status == BIN_OK && op == BIN_OP_EXIT) {
+    Serial.flush();
+    Serial.begin(9600);
+    debugBaud = 9600;
+    uartClock(0, debugBaud);
+    serialBinary = 0;
+  }
+}
+
+void binStart(){
+  binCrc = 0xFFFF;
+  Serial.write(SLIP_END);
+}
+
+void binSend(uint8_t data){
+  if (data == SLIP_END) {
+    Serial.write(SLIP_ESC);
+    Serial.write(SLIP_ESC_END);
+  } else if (data == SLIP_ESC) {
+    Serial.write(SLIP_ESC);
+    Serial.write(SLIP_ESC_ESC);
+  } else {
+    Serial.write(data);
+  }
+}
+
+void binPut(uint8_t data){
+  binCrc = crc16(binCrc, data);
+  binSend(data);
+}
+
+void binEnd(){
+  uint16_t crc = binCrc;
+  binSend(crc & 0xff);
+  binSend(crc >> 8);
+  Serial.write(SLIP_END);
+}
+
 //Start the program:
 void loop()
 {
+  uint32_t loopStart = latNow();
 
-  cmdPoll();
+  //The debug port either runs the command shell or the binary protocol.
+  if (serialBinary) binPoll();
+  else cmdPoll();
 
   //All functionality can be accessed via the Serial debug port.
   //  waitForSerialDebugInput();
@@ -328,6 +1316,41 @@ void loop()
   //This chaecks the control register for the EXEC signal to go high and starts the requested process.
   waitForControl();
 
+  //Advance a slave command in flight, if any.
+  serviceComms();
+
+  //Turn on the next slave of a power sequence, if it is time.
+  servicePower();
+
+  //Replay the cached attenuator settings to a slave that has come up.
+  serviceReplay();
+
+  //Log the trips the ADC interrupt has cut power for.
+  serviceTrips();
+
+  latRecord(LAT_LOOP, loopStart);
+
+  //Nothing left to do: sleep until the next interrupt.
+  sleepUntilEvent();
+}
+
+//Sleep in LPM0 until the next I2C, UART or timer interrupt. LPM0 keeps SMCLK, and with it the CARRIER and the UARTs, running.
+//receiveEvent() and a trip call wakeup(), and the watchdog tick behind millis() wakes us at least once a millisecond,
+//which keeps the retry backoff going. The monitoring scan runs from the ADC interrupt, asleep or not.
+//NOTE: That tick is the only wakeup the slave link has: Serial1 does not wake us when a byte has gone out or come in.
+//      So the CPU stays awake for the whole frame and response (COMMS_ECHO, COMMS_WAIT). Asleep, the comparator would
+//      be switched to the slave up to a millisecond late, and a slave that answers sooner loses the start of its reply.
+void sleepUntilEvent(){
+  noInterrupts();
+  //In binary mode the debug port runs too fast to leave its receive buffer alone for a millisecond.
+  if (readyWork() || serialBinary || commsState == COMMS_ECHO || commsState == COMMS_WAIT) {
+    interrupts();
+    return;
+  }
+  stay_asleep = true;
+  //Enabling interrupts and entering LPM0 is one instruction, so a wakeup in between cannot be missed.
+  __bis_SR_register(LPM0_bits | GIE);
+  stay_asleep = false;
 }
 
 
@@ -386,25 +1409,40 @@ uint8_t ascii(char data){
   else if(int(data)>96 && int(data)<103){
     return int(data) - 97 +10; 
   }
+  //Not a hex digit.
+  return 0;
 }
 
 
-// This module checks if any of the registers has changed, more precisely if any of the control bits are high. In that 
-// case it takes the appropriate action.
+//The posted flags that can be serviced now. A new slave command or batch, or a new link or clock setup, has to wait until the
+//command or batch in flight is done, so their flags stay posted until then.
+uint16_t readyWork(){
+  uint16_t work = pendingWork;
+  if (commsState != COMMS_IDLE || batchRunning || fanRunning) work &= ~(WORK_SLAVECTL | WORK_LINKCTL | WORK_BATCHCTL | WORK_CLKCTL);
+  //New I2C addresses wait for the end of a transaction on the bus.
+  if (UCB0STATW & UCBBUSY) work &= ~WORK_ADDRCTL;
+  return work;
+}
+
+// This module takes the appropriate action for every control register that has posted a pending-work flag.
+// All posted actions are serviced in one pass.
 void waitForControl(){
-  
-  if(i2cRegisterMap[0] & 0x80){
+  uint16_t work;
+  uint8_t i;
+
+  noInterrupts();
+  work = readyWork();
+  pendingWork &= ~work;
+  interrupts();
+
+  if((work & WORK_POWERCTL) && (i2cRegisterMap[0] & 0x80)){
 #if DEBUG_MODE
       Serial.print("Before:");
       Serial.print(i2cRegisterMap[0]);
       Serial.print(", ");
 #endif
-    //Start power control
-      power(0x0, (i2cRegisterMap[0] >> 0 ) &  0x1);
-      power(0x1, (i2cRegisterMap[0] >> 1 ) &  0x1);
-      power(0x2, (i2cRegisterMap[0] >> 2 ) &  0x1);
-      power(0x3, (i2cRegisterMap[0] >> 3 ) &  0x1);
-      i2cRegisterMap[0]&=~(0x80);
+    //Start power control. servicePower() finishes it, and clears bit [7].
+      powerSequence(i2cRegisterMap[0] & 0xf, 0);
 #if DEBUG_MODE
       Serial.print("After:");
       Serial.print(i2cRegisterMap[0]);
@@ -412,7 +1450,7 @@ void waitForControl(){
 #endif
 //      delay(100);
   }
-  else if(i2cRegisterMap[1] & 0x80){
+  if((work & WORK_POWERDFLT) && (i2cRegisterMap[1] & 0x80)){
 #if DEBUG_MODE
       Serial.print("Before:");
       Serial.print(", ");
@@ -420,6 +1458,7 @@ void waitForControl(){
 #endif
       //Update default power values
       my_info->power_default = i2cRegisterMap[1] & 0xf;
+      saveConfig();
       i2cRegisterMap[1]&=~(0x80);
 #if DEBUG_MODE
       Serial.print("After:");
@@ -429,7 +1468,7 @@ void waitForControl(){
 //      delay(100);
   }  
 
-  else if(i2cRegisterMap[2] & 0x80){
+  if((work & WORK_MONCTL) && (i2cRegisterMap[2] & 0x80)){
       i2cRegisterMap[3]=0x0;
 #if DEBUG_MODE
       Serial.print("Before:");
@@ -466,7 +1505,89 @@ void waitForControl(){
       }
   }  
 
-  else if(i2cRegisterMap[4] & 0x80){
+  if((work & WORK_TRIPCTL) && (i2cRegisterMap[REG_TRIPCTL] & 0x80)){
+      //Update the stored trip setup
+      for (i=0;i<4;i++) my_info->trip_threshold[i] = tripThreshold(i);
+      my_info->trip_enable = i2cRegisterMap[REG_TRIPCTL] & 0x1f;
+      saveConfig();
+      i2cRegisterMap[REG_TRIPCTL]&=~(0x80);
+  }
+
+  if((work & WORK_SEQCTL) && (i2cRegisterMap[REG_SEQCTL] & 0x80)){
+      //Update the stored power sequencer setup
+      my_info->seq_ctl = i2cRegisterMap[REG_SEQCTL] & 0x1;
+      my_info->seq_order = i2cRegisterMap[REG_SEQORDER];
+      for (i=0;i<4;i++) my_info->seq_delay[i] = i2cRegisterMap[REG_SEQDLY_BASE + i];
+      my_info->seq_settle = i2cRegisterMap[REG_SEQSETTLE];
+      saveConfig();
+      i2cRegisterMap[REG_SEQCTL]&=~(0x80);
+  }
+
+  if((work & WORK_LINKCTL) && (i2cRegisterMap[REG_LINKCTL] & 0x80)){
+      //Set up the slave link again, and store it if asked to
+      applyLink();
+      if (i2cRegisterMap[REG_LINKCTL] & 0x40) {
+        my_info->link_baud = i2cRegisterMap[REG_LINKCTL] & 0x7;
+        my_info->link_carrier = i2cRegisterMap[REG_CARRIER];
+        my_info->link_timeout = i2cRegisterMap[REG_TIMEOUT];
+        my_info->link_retry = i2cRegisterMap[REG_RETRY] & 0x7;
+        my_info->link_backoff = i2cRegisterMap[REG_BACKOFF];
+        saveConfig();
+      }
+      i2cRegisterMap[REG_LINKCTL]&=~(0xC0);
+  }
+
+  if((work & WORK_ADDRCTL) && (i2cRegisterMap[REG_ADDRCTL] & 0x80)){
+      //Switch to the new I2C addresses, and store them if asked to. A refused setup leaves the old addresses in use.
+      uint8_t ctl = i2cRegisterMap[REG_ADDRCTL];
+      ENTER_CRITICAL();
+      if (UCB0STATW & UCBBUSY) {
+        //A start condition came in since readyWork(). i2cBegin() would cut it off: try again next pass.
+        EXIT_CRITICAL();
+        postWork(WORK_ADDRCTL);
+      } else {
+        if (i2cBegin()) {
+          ctl &= 0x43;
+          if (ctl & 0x40) {
+            my_info->i2c_ctl = ctl & 0x3;
+            my_info->i2c_address = i2cRegisterMap[REG_I2CADDR];
+            my_info->i2c_group = i2cRegisterMap[REG_GROUPADDR];
+          }
+        } else {
+          ctl = (UCB0I2COA0 & UCGCEN ? 0x1 : 0) | (UCB0I2COA1 & UCOAEN ? 0x2 : 0) | 0x20;
+          i2cRegisterMap[REG_I2CADDR] = UCB0I2COA0 & 0x7f;
+          i2cRegisterMap[REG_GROUPADDR] = UCB0I2COA1 & 0x7f;
+        }
+        i2cRegisterMap[REG_ADDRCTL] = ctl & 0x23;
+        EXIT_CRITICAL();
+        if (ctl & 0x40) saveConfig();
+      }
+  }
+
+  if((work & WORK_CLKCTL) && (i2cRegisterMap[REG_CLKCTL] & 0x80)){
+      //Switch the clock profile, and store the one in use if asked to. applyClock() clears bits [7:6].
+      uint8_t store = i2cRegisterMap[REG_CLKCTL] & 0x40;
+      applyClock(i2cRegisterMap[REG_CLKCTL] & 0x3);
+      if (store) {
+        my_info->clock_profile = clockProfile;
+        saveConfig();
+      }
+  }
+
+  if((work & WORK_CALCTL) && (i2cRegisterMap[REG_CALCTL] & 0x80)){
+      //Get, set or reset the coefficients of one monitoring value. Each gain/offset pair changes with interrupts off, so
+      //the scan in the ADC interrupt never sees half of one.
+      calControl(i2cRegisterMap[REG_CALCTL]);
+      i2cRegisterMap[REG_CALCTL] &= 0x17;
+  }
+
+  if((work & WORK_STATCTL) && (i2cRegisterMap[REG_STATCTL] & 0x80)){
+      //Hand out and restart the statistics of one monitoring value
+      if ((i2cRegisterMap[REG_STATCTL] & 0x7) < OS_CHANNELS) readStatistics(i2cRegisterMap[REG_STATCTL] & 0x7);
+      i2cRegisterMap[REG_STATCTL]&=~(0x80);
+  }
+
+  if((work & WORK_SLAVECTL) && (i2cRegisterMap[4] & 0x80)){
 #if DEBUG_MODE
       Serial.print("Before:");
       Serial.print(", ");
@@ -478,27 +1599,46 @@ void waitForControl(){
       Serial.print(", ");
       Serial.print(i2cRegisterMap[7]);
 #endif
-      //Send command to slave.
-      runComms(i2cRegisterMap[4] & 0x3);
-#if DEBUG_MODE
-      Serial.print("After:");
-      Serial.print(i2cRegisterMap[4]);
-      Serial.print(", ");
-      Serial.print(i2cRegisterMap[5]);
-      Serial.print(", ");
-      Serial.print(i2cRegisterMap[6]);
-      Serial.print(", ");
-      Serial.print(i2cRegisterMap[7]);
-      Serial.print("\n");
-#endif
+      //Send command to slave. This only starts the transaction, serviceComms() finishes it.
+      if (i2cRegisterMap[4] & 0x20) {
+        startFanout();
+      } else if (attCached(i2cRegisterMap[4] & 0x3, i2cRegisterMap[5], i2cRegisterMap[6])) {
+        //The slave has this setting already.
+        i2cRegisterMap[REG_SLAVESTAT] = SLAVE_OK;
+        i2cRegisterMap[7] = i2cRegisterMap[6];
+        setResponse(&i2cRegisterMap[6], 1);
+        i2cRegisterMap[4]&=~(1u << 7);
+      } else {
+        runComms(i2cRegisterMap[4] & 0x3, i2cRegisterMap[5], i2cRegisterMap[6]);
+      }
 //      delay(100);
   }
+
+  if((work & WORK_BATCHCTL) && (i2cRegisterMap[REG_BATCHCTL] & 0x80)){
+    //SLAVECTL and BATCHCTL share the slave link. A SLAVECTL that started this pass has it busy, then the batch waits
+    //for the next pass. A batch the host has cancelled (bit [7] clear) is dropped.
+    if (commsState != COMMS_IDLE || batchRunning || fanRunning) {
+      postWork(WORK_BATCHCTL);
+    } else {
+      batchCount = i2cRegisterMap[REG_BATCHCTL] & 0xf;
+      if (batchCount > BATCH_MAX) batchCount = BATCH_MAX;
+      i2cRegisterMap[REG_BATCHCTL]&=~(0x40);
+      batchIndex = 0;
+      if (batchCount) {
+        batchRunning = 1;
+        runBatchEntry();
+      } else {
+        i2cRegisterMap[REG_BATCHCTL]&=~(0x80);
+      }
+    }
+  }
 }
 
 
+//Returns the latest background conversion, so MONCTL requests no longer wait for the ADC.
 uint16_t readMonitoring(uint8_t num){
   int val=0;
-  val = analogRead(analogPort[num]);
+  val = monLatest[num];
 #if DEBUG_MODE
   Serial.print("Monitoring: ");
   Serial.println(val);
@@ -506,165 +1646,1239 @@ uint16_t readMonitoring(uint8_t num){
 #endif
   return uint16_t(val);
 }
+
+//Set up the ADC for the background scan, and start it. The sketch drives the ADC itself, without analogRead() or
+//analogReference(): Energia's ADC10 interrupt handler comes with those, and ADC10_VECTOR belongs to monitorInterrupt().
+void setupMonitoring(){
+  uint8_t i;
+  uint8_t port;
+  for (i=0;i<MON_CHANNELS;i++) {
+    //Pins above 127 are internal channels (A10: temperature, A11: VCC/2), like in Energia's analogRead().
+    if (analogPort[i] > 127) {
+      monAdcChannel[i] = analogPort[i] - 128;
+      continue;
+    }
+    monAdcChannel[i] = digitalPinToADCIn(analogPort[i]);
+    port = digitalPinToPort(analogPort[i]);
+    if (port >= 1 && port <= 4) {
+      *adcSel0[port - 1] |= digitalPinToBitMask(analogPort[i]);
+      *adcSel1[port - 1] |= digitalPinToBitMask(analogPort[i]);
+    }
+  }
+  //1.5V reference on, ADC on, 10 bit, single channel single conversion. The end of each conversion interrupts.
+  REFCTL0 |= REFVSEL_0 | REFON;
+  ADC10CTL0 &= ~ADC10ENC;
+  ADC10CTL0 = ADC10SHT_8 | ADC10ON;
+  ADC10CTL1 = ADC10SHP | ADC10SSEL_0 | ADC10CONSEQ_0 | adcDivider[clockProfile];
+  ADC10CTL2 = ADC10RES;
+  ADC10IFG = 0;
+  ADC10IE = ADC10IE0;
+  monIndex = 0;
+  osCount = 0;
+  memset(osSum, 0, sizeof(osSum));
+  //MONx and CALx stay at zero until the first scan is done.
+  startConversion(0);
+}
+
+//Start a conversion of monitoring value num. The ADC window comparator is set up to flag a trip condition:
+//above the threshold for CUR0-CUR3, below half scale for !FAULT (active low).
+void startConversion(uint8_t num){
+  uint8_t enable = i2cRegisterMap[REG_TRIPCTL];
+  ADC10CTL0 &= ~ADC10ENC;
+  ADC10MCTL0 = ADC10SREF_1 | monAdcChannel[num];
+  ADC10HI = 0x3ff;
+  ADC10LO = 0x0;
+  if (num >= 1 && num <= 4 && (enable & (1u << (num - 1)))) ADC10HI = tripThreshold(num - 1);
+  if (num == 5 && (enable & 0x10)) ADC10LO = 0x200;
+  ADC10IFG &= ~(ADC10IFG0 | ADC10HIIFG | ADC10LOIFG);
+  ADC10CTL0 |= ADC10ENC | ADC10SC;
+}
+
+uint16_t tripThreshold(uint8_t dev){
+  return (i2cRegisterMap[REG_TRIPTHR_BASE + 2*dev] | (i2cRegisterMap[REG_TRIPTHR_BASE + 2*dev + 1] << 8)) & 0x3ff;
+}
+
+//The end of a conversion. A conversion that crossed the window cuts power right here, a single conversion time after
+//the fault; the log entry and the rest of the bookkeeping wait for serviceTrips() in loop().
+__attribute__((interrupt(ADC10_VECTOR)))
+void monitorInterrupt(void){
+  uint16_t val;
+  uint32_t start;
+  if (!(ADC10IFG & ADC10IFG0)) return;
+  start = latNow();
+  val = ADC10MEM0 & 0x3ff;
+  if (ADC10IFG & (ADC10HIIFG | ADC10LOIFG)) trip(monIndex, val);
+  collectConversion(val);
+  startConversion(monIndex);
+  latRecord(LAT_MONITOR, start);
+  if (!stay_asleep) __bic_SR_register_on_exit(LPM4_bits);
+}
+
+//Cut power for the conversion of monitoring value num that crossed the window, from the ADC interrupt.
+void trip(uint8_t num, uint16_t val){
+  uint8_t bit = (num == 5) ? 4 : num - 1;
+  uint8_t mask = (num == 5) ? 0xf : (1u << bit);
+  enWrite(mask, 0);
+  i2cRegisterMap[0] &= ~mask;
+  i2cRegisterMap[REG_TRIPSTAT] |= (1u << bit);
+  tripValue[bit] = val;
+  tripPending |= (1u << bit);
+  wakeup();
+}
+
+//Catch up with the trips of the ADC interrupt: power state, sequencer and log.
+void serviceTrips(){
+  uint8_t pending;
+  uint8_t bit;
+  uint8_t mask;
+  uint8_t before;
+  if (!tripPending) return;
+  ENTER_CRITICAL();
+  pending = tripPending;
+  tripPending = 0;
+  EXIT_CRITICAL();
+  for (bit=0;bit<5;bit++) {
+    if (!(pending & (1u << bit))) continue;
+    mask = (bit == 4) ? 0xf : (1u << bit);
+    before = powerState;
+    power(mask, 0);
+    seqPending &= ~mask;
+    //Only log trips that actually cut power, not every conversion while the condition lasts.
+    if (powerState != before) logEvent(LOG_TRIP, i2cRegisterMap[REG_TRIPSTAT], bit == 4 ? 5 : bit + 1, tripValue[bit] >> 2);
+  }
+}
+
+//Take the conversion of monitoring value monIndex, and move on to the next one.
+void collectConversion(uint16_t val){
+  uint8_t i;
+  if (monIndex < OS_CHANNELS) {
+    accumulateStatistics(monIndex, val);
+    osSum[monIndex] += val;
+  } else {
+    monScan[monIndex] = val;
+  }
+  if (++monIndex < MON_CHANNELS) return;
+  monIndex = 0;
+  //Oversample: sum up 4^osRatio scans, and decimate the sums to 10 + osRatio bits.
+  if (++osCount < (1u << (2*osRatio))) return;
+  for (i=0;i<OS_CHANNELS;i++) {
+    osValue[i] = osSum[i] >> osRatio;
+    monScan[i] = osValue[i] >> osRatio;
+    osSum[i] = 0;
+  }
+  osCount = 0;
+  memcpy(monLatest, monScan, sizeof(monLatest));
+  calibrateScan();
+  publishMonitoring();
+  //A new oversampling setting only takes effect at the start of a scan.
+  osRatio = i2cRegisterMap[REG_OSCTL] & 0x3;
+}
+
+void accumulateStatistics(uint8_t num, uint16_t val){
+  if (statCount[num] == 0 || val < statMin[num]) statMin[num] = val;
+  if (statCount[num] == 0 || val > statMax[num]) statMax[num] = val;
+  //Count and sum saturate together, so the mean stays right. A spike still shows in the extremes.
+  if (statCount[num] == 0xffff) return;
+  statSum[num] += val;
+  statCount[num]++;
+}
+
+//Copy the statistics of one monitoring value into the STAT registers, and start over.
+void readStatistics(uint8_t num){
+  uint16_t stat[5];
+  uint32_t sum;
+  uint8_t i;
+  //The ADC interrupt adds to the statistics, so take and restart them in one go.
+  noInterrupts();
+  stat[0] = osValue[num];
+  stat[1] = statMin[num];
+  stat[2] = statMax[num];
+  stat[4] = statCount[num];
+  sum = statSum[num];
+  statCount[num] = 0;
+  statSum[num] = 0;
+  interrupts();
+  stat[3] = stat[4] ? (sum << 6) / stat[4] : 0;
+  noInterrupts();
+  for (i=0;i<5;i++) {
+    i2cRegisterMap[REG_STAT_BASE + 2*i] = stat[i] & 0xff;
+    i2cRegisterMap[REG_STAT_BASE + 2*i + 1] = stat[i] >> 8;
+  }
+  interrupts();
+}
+
+//Copy the latest scan into the MONx registers. Interrupts are off, so an I2C read never sees a half updated bank.
+//During an I2C read the copy waits for the stop condition, where the I2C interrupt makes it.
+void publishMonitoring(){
+  uint8_t i;
+  ENTER_CRITICAL();
+  if (i2cReading) {
+    i2cMonPending = 1;
+    EXIT_CRITICAL();
+    return;
+  }
+  i2cMonPending = 0;
+  for (i=0;i<MON_CHANNELS;i++) {
+    i2cRegisterMap[REG_MON_BASE + 2*i] = monLatest[i] & 0xff;
+    i2cRegisterMap[REG_MON_BASE + 2*i + 1] = monLatest[i] >> 8;
+    i2cRegisterMap[REG_CAL_BASE + 2*i] = calLatest[i] & 0xff;
+    i2cRegisterMap[REG_CAL_BASE + 2*i + 1] = (uint16_t) calLatest[i] >> 8;
+  }
+  i2cRegisterMap[REG_MONSEQ]++;
+  EXIT_CRITICAL();
+}
   
 
 // function that executes whenever data is received from master
-// this function is registered as an event, see setup()
-void receiveEvent(int howMany) {
-  unsigned int i;
+// called from the I2C interrupt at the end of a write, with the bytes in i2cRx[]. A broadcast write leaves the
+// I2C addresses alone, so the boards keep their own.
+void receiveEvent(uint8_t howMany) {
+  uint8_t i;
+  uint32_t start;
   if (!howMany) return;
-  currentRegisterPointer= Wire.read();
-  currentRegisterPointer&=0x7;
-  howMany--;
-  for (i=0;i<howMany;i++) {
-    i2cRegisterMap[currentRegisterPointer++] = Wire.read();
-    currentRegisterPointer&=0x7;
+  start = latNow();
+  currentRegisterPointer = i2cRx[0];
+  currentRegisterPointer%=REG_MAX;
+  for (i=1;i<howMany;i++) {
+    if (!i2cBroadcast || currentRegisterPointer < REG_ADDRCTL || currentRegisterPointer > REG_GROUPADDR) {
+      writeRegister(currentRegisterPointer, i2cRx[i]);
+    }
+    if (++currentRegisterPointer == REG_MAX) currentRegisterPointer = 0;
+  }
+  if (i2cBroadcast) i2cRegisterMap[REG_BCCOUNT]++;
+  latRecord(LAT_RECEIVE, start);
+}
+
+//Read only registers are skipped by writes, but still advance the pointer.
+uint8_t regWritable(uint8_t reg){
+  if (reg >= REG_MON_BASE && reg <= REG_MONSEQ) return 0;
+  if (reg >= REG_SNAP_BASE && reg <= REG_SNAP_END) return 0;
+  if (reg >= REG_STAT_BASE && reg <= REG_STAT_END) return 0;
+  if (reg == REG_SLAVESTAT) return 0;
+  if (reg >= REG_BATCHRES_BASE && reg <= REG_BATCHRES_END) return 0;
+  if (reg >= REG_LOGSEQ && reg <= REG_LOGENTRY_END) return 0;
+  if (reg >= REG_LATCOUNT && reg <= REG_LATHIST_END) return 0;
+  if (reg == REG_SEQSTAT) return 0;
+  if (reg == REG_ATTSTAT) return 0;
+  if (reg >= REG_LQ_BASE && reg <= REG_LQ_END) return 0;
+  if (reg >= REG_FANRES_BASE && reg <= REG_FANRES_END) return 0;
+  if (reg == REG_BCCOUNT) return 0;
+  if (reg >= REG_RESPLEN && reg <= REG_RESP_END) return 0;
+  if (reg >= REG_CAL_BASE && reg <= REG_CAL_END) return 0;
+  return 1;
+}
+
+//All register writes (I2C and serial debug port) go through here. Anything that has to happen right away is done here,
+//everything else is picked up by waitForControl().
+void writeRegister(uint8_t reg, uint8_t val){
+  if (!regWritable(reg)) return;
+  if (reg == REG_SNAPCTL) {
+    if (val & 0x80) latchSnapshot();
+    return;
+  }
+  if (reg == REG_LOGCTL) {
+    if (val & 0x80) readLog();
+    return;
+  }
+  if (reg == REG_LATCTL) {
+    readLatency(val);
+    return;
+  }
+  if (reg == REG_LQCTL) {
+    if (val & 0x80) readLinkStat(val);
+    i2cRegisterMap[reg] = val & 0x3;
+    return;
+  }
+  if (reg == REG_ATTCTL) {
+    if (val & 0x40) attClear();
+    i2cRegisterMap[reg] = val & 0x3;
+    return;
+  }
+  //CLKCTL and ADDRCTL bit [5] is read only.
+  if (reg == REG_CLKCTL || reg == REG_ADDRCTL) val = (val & ~0x20) | (i2cRegisterMap[reg] & 0x20);
+  //CALCTL bit [4] too.
+  if (reg == REG_CALCTL) val = (val & ~0x10) | (i2cRegisterMap[reg] & 0x10);
+  i2cRegisterMap[reg] = val;
+  if (val & 0x80) {
+    if (reg == 0) postWork(WORK_POWERCTL);
+    else if (reg == 1) postWork(WORK_POWERDFLT);
+    else if (reg == 2) postWork(WORK_MONCTL);
+    else if (reg == 4) postWork(WORK_SLAVECTL);
+    else if (reg == REG_STATCTL) postWork(WORK_STATCTL);
+    else if (reg == REG_TRIPCTL) postWork(WORK_TRIPCTL);
+    else if (reg == REG_LINKCTL) postWork(WORK_LINKCTL);
+    else if (reg == REG_BATCHCTL) postWork(WORK_BATCHCTL);
+    else if (reg == REG_SEQCTL) postWork(WORK_SEQCTL);
+    else if (reg == REG_CLKCTL) postWork(WORK_CLKCTL);
+    else if (reg == REG_ADDRCTL) postWork(WORK_ADDRCTL);
+    else if (reg == REG_CALCTL) postWork(WORK_CALCTL);
+  }
+}
+
+//Flag an action for the main loop, and make sure it does not sleep through it.
+void postWork(uint16_t work){
+  ENTER_CRITICAL();
+  pendingWork |= work;
+  EXIT_CRITICAL();
+  wakeup();
+}
+
+//Add an event to the log. Interrupts are off, so readLog() never sees half an event.
+void logEvent(uint8_t type, uint8_t a, uint8_t b, uint8_t c){
+  log_entry_t *entry;
+  ENTER_CRITICAL();
+  entry = &my_log->entry[my_log->next];
+  entry->time = millis() / 1000;
+  entry->type = type;
+  entry->data[0] = a;
+  entry->data[1] = b;
+  entry->data[2] = c;
+  my_log->next = (my_log->next + 1) % LOG_ENTRIES;
+  my_log->seq++;
+  i2cRegisterMap[REG_LOGSEQ] = my_log->seq & 0xff;
+  i2cRegisterMap[REG_LOGSEQ + 1] = my_log->seq >> 8;
+  EXIT_CRITICAL();
+}
+
+//Copy event LOGCUR into LOGENTRY and advance LOGCUR. Called from writeRegister(), so in the I2C interrupt when it
+//comes from the host.
+void readLog(){
+  uint16_t cur = i2cRegisterMap[REG_LOGCUR] | (i2cRegisterMap[REG_LOGCUR + 1] << 8);
+  uint16_t seq;
+  uint8_t status = 0;
+  log_entry_t *entry;
+  ENTER_CRITICAL();
+  seq = my_log->seq;
+  //Events older than the last LOG_ENTRIES are gone. Unsigned math, so this also works when seq wraps.
+  if ((uint16_t)(seq - cur) > LOG_ENTRIES && (uint16_t)(seq - cur) <= 0x8000) {
+    cur = seq - LOG_ENTRIES;
+    status |= 0x40;
+  }
+  if (cur == seq || (uint16_t)(seq - cur) > 0x8000) {
+    memset(&i2cRegisterMap[REG_LOGENTRY_BASE], 0, 6);
+    status |= 0x20;
+  } else {
+    //seq is the event written into slot next - 1.
+    entry = &my_log->entry[(my_log->next + LOG_ENTRIES - (uint16_t)(seq - cur)) % LOG_ENTRIES];
+    i2cRegisterMap[REG_LOGENTRY_BASE] = entry->time & 0xff;
+    i2cRegisterMap[REG_LOGENTRY_BASE + 1] = entry->time >> 8;
+    i2cRegisterMap[REG_LOGENTRY_BASE + 2] = entry->type;
+    memcpy(&i2cRegisterMap[REG_LOGENTRY_BASE + 3], entry->data, 3);
+    cur++;
   }
+  i2cRegisterMap[REG_LOGCUR] = cur & 0xff;
+  i2cRegisterMap[REG_LOGCUR + 1] = cur >> 8;
+  i2cRegisterMap[REG_LOGCTL] = status;
+  EXIT_CRITICAL();
 }
-void requestEvent() {
-  Wire.write(i2cRegisterMap[currentRegisterPointer]);
+
+//Free running timer for the latency histograms: TB2 in continuous mode on SMCLK, with the overflow interrupt on.
+void setupLatency(){
+  TB2CTL = TBSSEL_2 | MC_2 | TBCLR | TBIE;
 }
 
+//Counts the overflows of TB2, which are the upper 16 bits of latNow().
+__attribute__((interrupt(TIMER2_B1_VECTOR)))
+void latOverflow(void){
+  if (TB2IV == TB2IV_TBIFG) latOverflows++;
+}
 
+//SMCLK cycles since setupLatency(), wrapping at 32 bits.
+uint32_t latNow(){
+  uint16_t lo;
+  uint16_t hi;
+  ENTER_CRITICAL();
+  lo = TB2R;
+  hi = latOverflows;
+  //An overflow that is not counted yet belongs to this reading if TB2R has wrapped already.
+  if ((TB2CTL & TBIFG) && lo < 0x8000) hi++;
+  EXIT_CRITICAL();
+  return ((uint32_t) hi << 16) | lo;
+}
 
-///This function wrappes the power control of the slave devices:
-void power(uint8_t dev, uint8_t on){
-  if(on){
-    digitalWrite(EN[dev], HIGH); 
+//Add the time since start to the histogram of path. Interrupts are off, so readLatency() never sees half an update.
+void latRecord(uint8_t path, uint32_t start){
+  uint32_t ticks = latNow() - start;
+  uint32_t t = ticks >> 4;
+  uint8_t bin = 0;
+  while (t && bin < LAT_BINS - 1) {
+    t >>= 2;
+    bin++;
   }
-  else{
-    digitalWrite(EN[dev], LOW); 
+  ENTER_CRITICAL();
+  if (latHist[path][bin] != 0xffff) latHist[path][bin]++;
+  latCount[path]++;
+  if (ticks > latMax[path]) latMax[path] = ticks;
+  EXIT_CRITICAL();
+}
+
+//Copy a latency histogram into the LAT registers, and/or clear all of them. Called from writeRegister(), so in the I2C
+//interrupt when it comes from the host.
+void readLatency(uint8_t val){
+  uint8_t path = val & 0x7;
+  uint8_t i;
+  ENTER_CRITICAL();
+  if (val & 0x80) {
+    memset(&i2cRegisterMap[REG_LATCOUNT], 0, REG_LATHIST_END - REG_LATCOUNT + 1);
+    if (path < LAT_PATHS) {
+      for (i=0;i<4;i++) {
+        i2cRegisterMap[REG_LATCOUNT + i] = latCount[path] >> (8*i);
+        i2cRegisterMap[REG_LATMAX + i] = latMax[path] >> (8*i);
+      }
+      for (i=0;i<LAT_BINS;i++) {
+        i2cRegisterMap[REG_LATHIST_BASE + 2*i] = latHist[path][i] & 0xff;
+        i2cRegisterMap[REG_LATHIST_BASE + 2*i + 1] = latHist[path][i] >> 8;
+      }
+    }
   }
+  if (val & 0x40) {
+    memset(latHist, 0, sizeof(latHist));
+    memset(latCount, 0, sizeof(latCount));
+    memset(latMax, 0, sizeof(latMax));
+  }
+  i2cRegisterMap[REG_LATCTL] = path;
+  EXIT_CRITICAL();
 }
 
-//Here the communication to the slave is actually sent:
-int runComms(uint8_t dev){
-  //1) Select output port
-  select_output(dev);
+//Latch a consistent telemetry snapshot. Called from writeRegister(), so in the I2C interrupt when it comes from the host:
+//the critical section restores the interrupt state it found.
+void latchSnapshot(){
+  uint8_t i;
+  uint8_t bit;
+  uint16_t val;
+  uint8_t *snap = &i2cRegisterMap[REG_SNAP_BASE];
+  ENTER_CRITICAL();
+  memset(snap, 0, 10);
+  for (i=0;i<MON_CHANNELS;i++) {
+    val = i2cRegisterMap[REG_MON_BASE + 2*i] | (i2cRegisterMap[REG_MON_BASE + 2*i + 1] << 8);
+    bit = 10*i;
+    snap[bit >> 3] |= val << (bit & 0x7);
+    //10 bit values always start on an even bit, so they never span more than 2 bytes.
+    snap[(bit >> 3) + 1] |= val >> (8 - (bit & 0x7));
+  }
+  snap[10] = i2cRegisterMap[0] & 0x8f;
+  //!FAULT is active low.
+  if (i2cRegisterMap[REG_MON_BASE + 2*5 + 1] < 0x2) snap[10] |= 0x10;
+  snap[11] = FIRMWARE_VERSION;
+  snap[12] = my_info->serno;
+  snap[13] = i2cRegisterMap[REG_MONSEQ];
+  EXIT_CRITICAL();
+}
+
+//Addresses the I2C specification keeps for itself.
+uint8_t i2cReserved(uint8_t address){
+  return address < 0x08 || address > 0x77;
+}
+
+//I2C slave on eUSCI_B0, on the addresses in ADDRCTL, I2CADDR and GROUPADDR. Returns 0, and leaves the bus alone, if
+//they cannot be used. UCB0SDA and UCB0SCL are P1.6 and P1.7.
+uint8_t i2cBegin(){
+  uint8_t ctl = i2cRegisterMap[REG_ADDRCTL];
+  uint8_t address = i2cRegisterMap[REG_I2CADDR];
+  uint8_t group = i2cRegisterMap[REG_GROUPADDR];
+  if (i2cReserved(address)) return 0;
+  if ((ctl & 0x2) && (i2cReserved(group) || group == address)) return 0;
+  P1SEL0 &= ~((1u << 6) | (1u << 7));
+  P1SEL1 |= (1u << 6) | (1u << 7);
+  UCB0CTLW0 = UCSWRST;
+  UCB0CTLW0 |= UCMODE_3 | UCSYNC;
+  UCB0I2COA0 = UCOAEN | ((ctl & 0x1) ? UCGCEN : 0) | address;
+  //The group address is kept in I2COA1 when it is off too, so a refused setup can put it back into GROUPADDR.
+  UCB0I2COA1 = ((ctl & 0x2) ? UCOAEN : 0) | group;
+  UCB0CTLW0 &= ~UCSWRST;
+  UCB0IE = UCSTTIE | UCSTPIE | UCRXIE0 | UCTXIE0;
+  i2cRxLength = 0;
+  i2cReading = 0;
+  return 1;
+}
 
-  //2) Start communication:
-  Serial1.write('!');
-  Serial1.write('M');
-  Serial1.write('!');
-  Serial1.write(i2cRegisterMap[5]);
-  Serial1.write(i2cRegisterMap[6]);
-  Serial1.write(0xFF);
+//A read is served from the register map as the bus asks for it, one byte per interrupt: the first byte goes into TXBUF
+//right at the start condition, so SCL is not held low for a callback or a copy. A write is collected and handed to
+//receiveEvent() at the stop condition, or at the repeated start of a write-then-read. Those two handlers do the work,
+//their time goes into the LAT_I2C histogram.
+__attribute__((interrupt(USCI_B0_VECTOR)))
+void i2cInterrupt(void){
+  uint32_t start;
+  switch (UCB0IV) {
+    case USCI_I2C_UCSTTIFG:
+      start = latNow();
+      receiveEvent(i2cRxLength);
+      i2cRxLength = 0;
+      //Anything but the own address is a broadcast: general call or group address.
+      i2cBroadcast = (UCB0ADDRX & 0x7f) != (UCB0I2COA0 & 0x7f);
+      if (UCB0CTLW0 & UCTR) {
+        i2cReading = 1;
+        i2cTxReg = currentRegisterPointer;
+        UCB0TXBUF = i2cBroadcast ? 0xFF : i2cRegisterMap[i2cTxReg];
+      }
+      latRecord(LAT_I2C, start);
+      break;
+    case USCI_I2C_UCRXIFG0:
+      if (i2cRxLength < I2C_RX_MAX) i2cRx[i2cRxLength++] = UCB0RXBUF;
+      else (void) UCB0RXBUF;
+      break;
+    case USCI_I2C_UCTXIFG0:
+      if (++i2cTxReg == REG_MAX) i2cTxReg = 0;
+      UCB0TXBUF = i2cBroadcast ? 0xFF : i2cRegisterMap[i2cTxReg];
+      break;
+    case USCI_I2C_UCSTPIFG:
+      start = latNow();
+      receiveEvent(i2cRxLength);
+      i2cRxLength = 0;
+      i2cReading = 0;
+      if (i2cMonPending) publishMonitoring();
+      latRecord(LAT_I2C, start);
+      break;
+  }
+  if (!stay_asleep) __bic_SR_register_on_exit(LPM4_bits);
+}
 
 
-  //3) Start with comparator setup after message has been sent:
-  delay(10); //Wait a moment because transmit echo is picked up by the RX line. 10us should be sufficient.
-  setup_comparator(dev);
-  //4) Wait for response:
-  if(0 == waitForResponse(dev) ){
 
-    //Reset control register after succesfull transmission.
-    i2cRegisterMap[4]&=~(1u << 7);
+//Look up the port registers and bits of EN[] and COMMS_SEL[].
+void setupPins(){
+  volatile uint8_t *out;
+  uint8_t dev;
+  uint8_t i;
+  for (dev=0;dev<4;dev++) {
+    out = portOutputRegister(digitalPinToPort(EN[dev]));
+    for (i=0;i<enPorts && enPortOut[i] != out;i++);
+    if (i == enPorts) enPortOut[enPorts++] = out;
+    enPortIndex[dev] = i;
+    enBit[dev] = digitalPinToBitMask(EN[dev]);
   }
-  else{//Timeout returns -1
-    i2cRegisterMap[4]|=(1u << 6);
-    i2cRegisterMap[4]&=~(1u << 7);
+  for (i=0;i<2;i++) {
+    selOut[i] = portOutputRegister(digitalPinToPort(COMMS_SEL[i]));
+    selBit[i] = digitalPinToBitMask(COMMS_SEL[i]);
   }
-  //5) End with comparator shutdown for power saving (FIXME: do we need this?):
-  shutdown_comparator();
-  return 0;
 }
 
-//Set the signal to the bus multiplexer.
-void select_output(uint8_t dev){
-  if(dev==0x0){ 
-    write_comms_sel(0x2); 
+//Switch the EN pins of all slaves in mask. One write per port, back to back with interrupts off.
+void enWrite(uint8_t mask, uint8_t on){
+  uint8_t bits[4] = {0, 0, 0, 0};
+  uint8_t dev;
+  uint8_t i;
+  for (dev=0;dev<4;dev++) {
+    if (mask & (1u << dev)) bits[enPortIndex[dev]] |= enBit[dev];
   }
-  else if(dev==0x1){ 
-    write_comms_sel(0x3); 
+  ENTER_CRITICAL();
+  for (i=0;i<enPorts;i++) {
+    if (!bits[i]) continue;
+    if (on) *enPortOut[i] |= bits[i];
+    else *enPortOut[i] &= ~bits[i];
   }
-  else if(dev==0x2){ 
-    write_comms_sel(0x0); 
+  EXIT_CRITICAL();
+}
+
+///This function wrappes the power control of the slave devices. All slaves in mask are switched together.
+void power(uint8_t mask, uint8_t on){
+  uint8_t dev;
+  mask &= 0xf;
+  enWrite(mask, on);
+  for (dev=0;dev<4;dev++) {
+    if (!(mask & (1u << dev))) continue;
+    if (on) {
+      //A slave that just came up needs its attenuator settings again.
+      if (!(powerState & (1u << dev))) {
+        attPowerOn[dev] = millis();
+        attReplay |= (1u << dev);
+      }
+    } else {
+      attSynced[dev] = 0;
+      attReplay &= ~(1u << dev);
+    }
   }
-  else if(dev==0x3){ 
-    write_comms_sel(0x1); 
+  if (on) powerState |= mask;
+  else powerState &= ~mask;
+  attStatus();
+}
+
+void attStatus(){
+  i2cRegisterMap[REG_ATTSTAT] = attReplay | (attFailed << 4);
+}
+
+//Forget all cached attenuator settings.
+void attClear(){
+  memset(my_att->setting, ATT_NONE, sizeof(my_att->setting));
+  memset(attSynced, 0, sizeof(attSynced));
+}
+
+//The gain of the line through the temperature sensor calibration of the device, 0 if it cannot be used.
+int32_t calTempGain(){
+  uint16_t t30 = adcTempCal[0];
+  uint16_t t85 = adcTempCal[1];
+  int32_t gain;
+  if (t85 <= t30 || t85 > 0x3ff) return 0;
+  gain = (5500L * 256 + (t85 - t30) / 2) / (t85 - t30);
+  return gain > 32767 ? 0 : gain;
+}
+
+//The default coefficients of monitoring value ch, see CALx.
+void calDefault(uint8_t ch){
+  uint8_t i = CAL_INDEX(ch);
+  short gain = (ch == 6) ? CAL_VCC : CAL_MV;
+  short offset = 0;
+  //Temperature: 30 degC at T30, and the slope of the device.
+  if (ch == CAL_TEMP && calTempRef) {
+    gain = calTempGain();
+    offset = 3000;
   }
+  ENTER_CRITICAL();
+  calGain[i] = gain;
+  calOffset[i] = offset;
+  EXIT_CRITICAL();
 }
 
+//Take the stored coefficients if there are, the defaults otherwise.
+void calLoad(){
+  uint8_t ch;
+  //CAL7 counts from T30 whenever the device has a usable calibration, also with stored coefficients.
+  if (calTempGain()) {
+    calTempRef = adcTempCal[0];
+    i2cRegisterMap[REG_CALCTL] &= ~0x10;
+  } else {
+    calTempRef = 0;
+    i2cRegisterMap[REG_CALCTL] |= 0x10;
+  }
+  if (my_cal->signature == CAL_SIGNATURE) {
+    memcpy(calGain, my_cal->gain, sizeof(calGain));
+    memcpy(calOffset, my_cal->offset, sizeof(calOffset));
+    return;
+  }
+  for (ch=0;ch<MON_CHANNELS;ch++) {
+    if (ch != CAL_FAULT) calDefault(ch);
+  }
+}
 
-//Same as above, just trying to make the code a bit smoother.
-void write_comms_sel(uint8_t sel){
-  if(sel & 0x1){
-    digitalWrite(COMMS_SEL[0], HIGH );
-  } 
-  else{
-    digitalWrite(COMMS_SEL[0], LOW );
+//Write all coefficients in use to FRAM. The table is only valid again once it is complete.
+void calStore(){
+  my_cal->signature = 0;
+  memcpy(my_cal->gain, calGain, sizeof(calGain));
+  memcpy(my_cal->offset, calOffset, sizeof(calOffset));
+  my_cal->signature = CAL_SIGNATURE;
+}
+
+//CALCTL with bit [7], from waitForControl(). The new coefficients show in CALx with the next scan. CALGAIN and CALOFS are
+//taken and handed out with interrupts off, so a host write or read in between never mixes two pairs.
+void calControl(uint8_t val){
+  uint8_t ch = val & 0x7;
+  uint8_t i = CAL_INDEX(ch);
+  short gain;
+  short offset;
+  if (ch == CAL_FAULT) {
+    gain = 0;
+    offset = 0;
+  } else {
+    if (val & 0x20) {
+      calDefault(ch);
+      calStore();
+    } else if (val & 0x40) {
+      ENTER_CRITICAL();
+      gain = i2cRegisterMap[REG_CALGAIN] | (i2cRegisterMap[REG_CALGAIN + 1] << 8);
+      offset = i2cRegisterMap[REG_CALOFS] | (i2cRegisterMap[REG_CALOFS + 1] << 8);
+      calGain[i] = gain;
+      calOffset[i] = offset;
+      EXIT_CRITICAL();
+      calStore();
+    }
+    gain = calGain[i];
+    offset = calOffset[i];
   }
+  ENTER_CRITICAL();
+  i2cRegisterMap[REG_CALGAIN] = gain & 0xff;
+  i2cRegisterMap[REG_CALGAIN + 1] = (uint16_t) gain >> 8;
+  i2cRegisterMap[REG_CALOFS] = offset & 0xff;
+  i2cRegisterMap[REG_CALOFS + 1] = (uint16_t) offset >> 8;
+  EXIT_CRITICAL();
+}
 
-  if(sel & 0x2){
-    digitalWrite(COMMS_SEL[1], HIGH );
-  } 
-  else{
-    digitalWrite(COMMS_SEL[1], LOW );
+//Monitoring value ch in engineering units, from a conversion with shift extra bits. Fixed point all the way: one
+//16 x 16 bit multiply, rounded.
+int16_t calApply(uint8_t ch, uint16_t value, uint8_t shift){
+  uint8_t i = CAL_INDEX(ch);
+  int32_t v;
+  if (ch == CAL_FAULT) return value >> shift;
+  v = (int32_t) value;
+  if (ch == CAL_TEMP) v -= (int32_t) calTempRef << shift;
+  v *= calGain[i];
+  v = (v + (1L << (7 + shift))) >> (8 + shift);
+  v += calOffset[i];
+  if (v > 32767) v = 32767;
+  if (v < -32768) v = -32768;
+  return v;
+}
+
+//The scan that just finished in engineering units. Values 0-4 are taken oversampled, with all their bits.
+void calibrateScan(){
+  uint8_t i;
+  for (i=0;i<MON_CHANNELS;i++) {
+    if (i < OS_CHANNELS) calLatest[i] = calApply(i, osValue[i], osRatio);
+    else calLatest[i] = calApply(i, monLatest[i], 0);
   }
 }
 
-//Comparator needs to be set up to receive return from the right slave:
-void setup_comparator(uint8_t dev){
+//Is this an attenuator setting the slave has acknowledged already, since it was powered on?
+uint8_t attCached(uint8_t dev, uint8_t command, uint8_t arg){
+  if (!(i2cRegisterMap[REG_ATTCTL] & 0x2) || command >= ATT_SETTINGS) return 0;
+  return (attSynced[dev] & (1u << command)) && my_att->setting[dev][command] == arg;
+}
+
+//Keep the value the slave acknowledged for an attenuator command, which is what it has set: a slave that clamps the
+//argument acknowledges less. FRAM is only written when it changes.
+void attUpdate(int ret){
+  uint8_t command = commsFrame[3];
+  if (ret != 0 || command >= ATT_SETTINGS) return;
+  if (my_att->setting[commsDev][command] != commsAck) my_att->setting[commsDev][command] = commsAck;
+  attSynced[commsDev] |= (1u << command);
+}
+
+//Start the replay to a slave that has been up for ATT_REPLAY_MS, when the slave link is free.
+void serviceReplay(){
+  uint8_t dev;
+  if (!attReplay || attReplaying || commsState != COMMS_IDLE || batchRunning || fanRunning) return;
+  if (!(i2cRegisterMap[REG_ATTCTL] & 0x1)) {
+    attReplay = 0;
+    attStatus();
+    return;
+  }
+  for (dev=0;dev<4;dev++) {
+    if ((attReplay & (1u << dev)) && millis() - attPowerOn[dev] >= ATT_REPLAY_MS) {
+      attDev = dev;
+      attIndex = 0;
+      attReplaying = 1;
+      attFailed &= ~(1u << dev);
+      attReplayNext();
+      return;
+    }
+  }
+}
+
+//Send the next cached setting the slave does not have yet, or finish the replay.
+void attReplayNext(){
+  uint8_t val;
+  while (attIndex < ATT_SETTINGS && (powerState & (1u << attDev))) {
+    val = my_att->setting[attDev][attIndex];
+    if (val != ATT_NONE && !(attSynced[attDev] & (1u << attIndex))) {
+      runComms(attDev, attIndex, val);
+      return;
+    }
+    attIndex++;
+  }
+  attReplaying = 0;
+  attReplay &= ~(1u << attDev);
+  attStatus();
+}
+
+void attEntryDone(int ret){
+  if (ret != 0) {
+    attFailed |= (1u << attDev);
+    attIndex = ATT_SETTINGS;
+  }
+  attReplayNext();
+}
+
+//Power the slaves in target. Slaves that have to go off do so right away, the others are queued for servicePower().
+//A new target replaces a sequence that is still running.
+void powerSequence(uint8_t target, uint8_t source){
+  if (seqState == SEQ_IDLE) seqBefore = powerState;
+  //Everything that goes off goes off at once.
+  power(~target & 0xf, 0);
+  seqPending = target & ~powerState & 0xf;
+  seqStep = 0;
+  seqSource = source;
+  //Nothing to wait for: the first slave goes on right away.
+  seqState = SEQ_SETTLE;
+  seqDev = 0xff;
+  i2cRegisterMap[REG_SEQSTAT] = 0x80 | seqPending;
+  servicePower();
+}
+
+//The next slave to turn on: in SEQORDER, then any left out of it. 0xff when there is none.
+uint8_t seqNext(){
+  uint8_t dev;
+  while (seqStep < 4) {
+    dev = (i2cRegisterMap[REG_SEQORDER] >> (2*seqStep)) & 0x3;
+    seqStep++;
+    if (seqPending & (1u << dev)) return dev;
+  }
+  for (dev=0;dev<4;dev++) {
+    if (seqPending & (1u << dev)) return dev;
+  }
+  return 0xff;
+}
+
+//Advance the power sequence, if one runs. Returns right away while the slave turned on last is still settling.
+void servicePower(){
+  uint8_t dev;
+  if (seqState == SEQ_IDLE) return;
+  if (seqState == SEQ_DELAY) {
+    if (millis() - seqStart < 10UL * i2cRegisterMap[REG_SEQDLY_BASE + seqDev]) return;
+    seqStart = millis();
+    seqMonSeq = i2cRegisterMap[REG_MONSEQ];
+    seqState = SEQ_SETTLE;
+  }
+  if (seqDev != 0xff && (i2cRegisterMap[REG_SEQCTL] & 0x1) && (powerState & (1u << seqDev))) {
+    //Only a scan that started after the delay counts, so wait for MONSEQ to move on twice.
+    if ((uint8_t)(i2cRegisterMap[REG_MONSEQ] - seqMonSeq) < 2 ||
+        (monLatest[1 + seqDev] >> 2) > i2cRegisterMap[REG_SEQSETTLE]) {
+      if (millis() - seqStart < SEQ_SETTLE_MS) return;
+      //Did not settle: leave the rest off.
+      noInterrupts();
+      i2cRegisterMap[0] &= ~seqPending;
+      interrupts();
+      seqPending = 0;
+      i2cRegisterMap[REG_SEQSTAT] |= 0x40;
+    }
+  }
+  dev = seqNext();
+  if (dev != 0xff) {
+    power(1u << dev, 1);
+    seqPending &= ~(1u << dev);
+    seqDev = dev;
+    seqStart = millis();
+    seqState = SEQ_DELAY;
+    i2cRegisterMap[REG_SEQSTAT] = (i2cRegisterMap[REG_SEQSTAT] & 0x40) | 0x80 | seqPending;
+    return;
+  }
+  seqState = SEQ_IDLE;
+  i2cRegisterMap[REG_SEQSTAT] &= 0x40;
+  //A POWERCTL write that came in meanwhile starts the next sequence, so its bit [7] has to stay.
+  noInterrupts();
+  if (!(pendingWork & WORK_POWERCTL)) i2cRegisterMap[0] &= ~0x80;
+  interrupts();
+  if (seqBefore != powerState) logEvent(LOG_POWER, seqBefore, powerState, seqSource);
+}
+
+//Set up the slave UART, the CARRIER and the response timeout from LINKCTL, CARRIER and TIMEOUT.
+void applyLink(){
+  uint8_t sel = i2cRegisterMap[REG_LINKCTL] & 0x7;
+  //A rate that does not exist leaves the one in use. LINKCTL and TIMEOUT show what is applied.
+  if (sel > 4) {
+    sel = 0;
+    while (sel < 4 && slaveBaudRates[sel] != slaveBaud) sel++;
+  }
+  ENTER_CRITICAL();
+  i2cRegisterMap[REG_LINKCTL] = (i2cRegisterMap[REG_LINKCTL] & ~0x7) | sel;
+  if (!i2cRegisterMap[REG_TIMEOUT]) i2cRegisterMap[REG_TIMEOUT] = 1;
+  EXIT_CRITICAL();
+  slaveBaud = slaveBaudRates[sel];
+  Serial1.begin(slaveBaud);
+  //Gap between response bytes: 5 characters, plus a millisecond for the granularity of millis().
+  slaveGapMs = 2 + 50000UL / slaveBaud;
+  slaveTimeoutMs = 10UL * i2cRegisterMap[REG_TIMEOUT];
+  //The clock profile sets up the CARRIER and the UART dividers for its SMCLK. A CARRIER it cannot make takes it back
+  //to profile 0.
+  applyClock(clockProfile);
+}
 
-  //2) Set the Comparator_D input channel:
-  if(dev == 0){
-    CDCTL0 |= (11u << 8);//V-=CD3
-    CDCTL0 |= (1111u << 0);//V+=CD15
-    //   Serial.print("setup 0");
+//TB1CCR0 for the CARRIER register at the SMCLK of a clock profile, or -1 if that SMCLK cannot make the frequency exactly.
+int16_t carrierPeriod(uint8_t profile){
+  uint8_t shift = clockShift[profile];
+  uint16_t cycles = i2cRegisterMap[REG_CARRIER] + 1;
+  //0 stops the CARRIER at any clock.
+  if (!i2cRegisterMap[REG_CARRIER]) return 0;
+  if ((cycles & ((1u << shift) - 1)) || (cycles >> shift) < 2) return -1;
+  return (cycles >> shift) - 1;
+}
+
+//Switch the clocks to a profile, and set up everything that runs from SMCLK again: the watchdog interval for millis(),
+//the CARRIER and the UART dividers.
+void applyClock(uint8_t profile){
+  int16_t period;
+  uint16_t ctl1 = clkBootCtl1;
+  uint16_t ctl3 = clkBootCtl3;
+  uint8_t status = 0;
+  if (profile >= CLK_PROFILES) profile = 0;
+  period = carrierPeriod(profile);
+  if (period < 0) {
+    profile = 0;
+    period = carrierPeriod(0);
+    status = 0x20;
+  }
+  if (profile == CLK_LOWCPU) ctl3 = (ctl3 & ~(DIVM0 | DIVM1 | DIVM2)) | DIVM__8;
+  if (profile == CLK_LOWPOWER) {
+    ctl1 = DCOFSEL_3;
+    ctl3 = (ctl3 & ~(DIVM0 | DIVM1 | DIVM2 | DIVS0 | DIVS1 | DIVS2)) | DIVS__8 | DIVM__8;
+  }
+
+  ENTER_CRITICAL();
+  CSCTL0_H = CSKEY >> 8;
+  CSCTL1 = ctl1;
+  CSCTL3 = ctl3;
+  CSCTL0_H = 0;
+  WDTCTL = WDTPW | WDTCNTCL | (clkBootWdt & ~(WDTIS0 | WDTIS1 | WDTIS2)) |
+    (clockShift[profile] ? WDTIS_6 : (clkBootWdt & (WDTIS0 | WDTIS1 | WDTIS2)));
+  //The ADC divider only changes with the ADC stopped, so the conversion in flight starts over.
+  ADC10CTL0 &= ~ADC10ENC;
+  ADC10CTL1 = (ADC10CTL1 & ~ADC10DIV_7) | adcDivider[profile];
+  if (ADC10CTL0 & ADC10ON) startConversion(monIndex);
+  EXIT_CRITICAL();
+  clockProfile = profile;
+
+  //Restart the CARRIER timer with the new period, so the counter is never left above it.
+  TB1CTL &= ~(0x3u << 4);
+  TB1CCR0 = period;
+  TB1CTL |= (1u << 2);
+  TB1CTL |= (01u << 4);
+
+  uartClock(0, debugBaud);
+  uartClock(1, slaveBaud);
+  i2cRegisterMap[REG_CLKCTL] = status | profile;
+}
+
+//UART dividers for the SMCLK of the clock profile in use, so they are right again after a switch. Port 0 is the debug
+//port (UCA0), port 1 the slave link (UCA1). At 1MHz the slave link rates take the dividers of the user's guide table,
+//anything else gets the oversampling divider Energia's begin() works out.
+const uint8_t uartSlowBr[5] = {6, 3, 1, 17, 8};
+const uint16_t uartSlowMctl[5] = {0x2081, 0x0241, 0x00A1, 0x4A00, 0xD600};
+void uartClock(uint8_t port, unsigned long baud){
+  uint16_t br;
+  uint16_t mctl;
+  uint16_t ie;
+  uint8_t i;
+  if (!baud) return;
+  for (i=0;i<5 && slaveBaudRates[i] != baud;i++);
+  if (clockShift[clockProfile] && i < 5) {
+    br = uartSlowBr[i];
+    mctl = uartSlowMctl[i];
+  } else {
+    br = (16000000UL >> clockShift[clockProfile]) / baud;
+    mctl = 0;
+    if (br >= 16) {
+      mctl = UCOS16 | ((br & 0xf) << 4);
+      br >>= 4;
+    }
+    if (!br) br = 1;
+  }
+  //UCSWRST clears the interrupt enables, and Energia's driver needs them back: without UCRXIE nothing is received
+  //anymore, without UCTXIE a write in progress stalls. No UART interrupt comes in before they are back.
+  ENTER_CRITICAL();
+  if (port == 0) {
+    ie = UCA0IE;
+    UCA0CTLW0 |= UCSWRST;
+    UCA0BRW = br;
+    UCA0MCTLW = mctl;
+    UCA0CTLW0 &= ~UCSWRST;
+    UCA0IE = ie;
+  } else {
+    ie = UCA1IE;
+    UCA1CTLW0 |= UCSWRST;
+    UCA1BRW = br;
+    UCA1MCTLW = mctl;
+    UCA1CTLW0 &= ~UCSWRST;
+    UCA1IE = ie;
+  }
+  EXIT_CRITICAL();
+}
+
+//Here the communication to the slave is actually sent:
+int runComms(uint8_t dev, uint8_t command, uint8_t arg){
+  //The frame is latched, so the host may rewrite COMMAND/ARG while this is in flight, and retries send the same.
+  commsFrame[0] = '!';
+  commsFrame[1] = 'M';
+  commsFrame[2] = '!';
+  commsFrame[3] = command;
+  commsFrame[4] = arg;
+  commsFrame[5] = 0xFF;
+
+  commsDev = dev;
+  commsBegin = millis();
+  commsTries = 0;
+  sendComms();
+  return 0;
+}
+
+//Send the latched frame to slave commsDev.
+void sendComms(){
+  latCommsMark = latNow();
+  //1) Select output port
+  select_output(commsDev);
+
+  //Drop anything left over from an earlier transaction:
+  while (Serial1.available()) Serial1.read();
+
+  //2) Start communication.
+  Serial1.write(commsFrame, COMMS_FRAME_LENGTH);
+  //In a fan-out the comparator is switched over while the frame goes out, the echo is thrown away anyway.
+  if (fanRunning) setup_comparator(commsDev);
+
+  commsEcho = 0;
+  commsStart = micros();
+  commsSent = commsStart;
+  commsState = COMMS_ECHO;
+}
+
+//Advance the slave transaction in flight. Returns immediately if there is nothing to do.
+void serviceComms(){
+  int ret;
+  if (commsState == COMMS_BACKOFF) {
+    if (millis() - commsStart < commsBackoff) return;
+    sendComms();
+    return;
   }
-  if(dev == 1){
-    CDCTL0 |= (101u << 8);//V-=CD5
-    CDCTL0 |= (100u << 0);//V+=CD4
+  if (commsState == COMMS_ECHO) {
+    //3) Swallow the transmit echo. Once the frame is out, start with comparator setup:
+    while (Serial1.available() && commsEcho < COMMS_FRAME_LENGTH) {
+      if (Serial1.read() == commsFrame[commsEcho]) commsEcho++;
+    }
+    if (commsEcho < COMMS_FRAME_LENGTH &&
+        (micros() - commsStart) < (COMMS_FRAME_LENGTH + 1)*10*(1000000UL/slaveBaud)) return;
+    while (Serial1.available()) Serial1.read();
+    latRecord(LAT_SLAVE_TX, latCommsMark);
+    latCommsMark = latNow();
+    if (!fanRunning) setup_comparator(commsDev);
+    memset(c, 0, sizeof(c));
+    nReceived = 0;
+    nExpected = expectedBytes_UART;
+    nSkipped = 0;
+    commsStart = millis();
+    commsState = COMMS_WAIT;
   }
-  if(dev == 2){
-    CDCTL0 |= (111u << 8);//V-=CD7
-    CDCTL0 |= (110u << 0);//V+=CD6
+  if (commsState == COMMS_WAIT) {
+    //4) Wait for response:
+    ret = waitForResponse(commsDev);
+    if (ret > 0) return;
+    //5) End with comparator shutdown for power saving (FIXME: do we need this?). A fan-out does it when all slaves are done.
+    if (!fanRunning) shutdown_comparator();
+    countLinkStat();
+    //6) Send it again after a while, if retries are left:
+    if (ret != 0 && commsTries < (i2cRegisterMap[REG_RETRY] & 0x7)) {
+      commsTries++;
+      commsBackoff = (unsigned long) i2cRegisterMap[REG_BACKOFF] << (commsTries - 1);
+      commsStart = millis();
+      commsState = COMMS_BACKOFF;
+      return;
+    }
+    i2cRegisterMap[REG_SLAVESTAT] |= commsTries << 4;
+    commsState = COMMS_IDLE;
+    if (ret != 0) logSlave();
+    attUpdate(ret);
+    if (attReplaying) {
+      attEntryDone(ret);
+      return;
+    }
+    if (batchRunning) {
+      batchEntryDone(ret);
+      return;
+    }
+    if (fanRunning) {
+      fanEntryDone(ret);
+      return;
+    }
+    if (ret == 0) {
+      //Reset control register after succesfull transmission.
+      i2cRegisterMap[7] = commsAck;
+      if (c[1] == 'L') setResponse(&c[4], c[3]);
+      else setResponse(&c[3], 1);
+      i2cRegisterMap[4]&=~(1u << 7);
+    }
+    else{//Timeout or bad response returns -1
+      setResponse(c, 0);
+      i2cRegisterMap[4]|=(1u << 6);
+      i2cRegisterMap[4]&=~(1u << 7);
+    }
+#if DEBUG_MODE
+    Serial.print("After:");
+    Serial.print(i2cRegisterMap[4]);
+    Serial.print(", ");
+    Serial.print(i2cRegisterMap[7]);
+    Serial.print("\n");
+#endif
   }
-  if(dev == 3){
-    CDCTL0 |= (1001u << 8);//V-=CD9
-    CDCTL0 |= (1000u << 0);//V+=CD8
+}
+
+//Fill the response mailbox, in one go for the host.
+void setResponse(const void *data, uint8_t len){
+  ENTER_CRITICAL();
+  i2cRegisterMap[REG_RESPLEN] = len;
+  memcpy(&i2cRegisterMap[REG_RESP_BASE], data, len);
+  memset(&i2cRegisterMap[REG_RESP_BASE + len], 0, RESP_MAX - len);
+  EXIT_CRITICAL();
+}
+
+//Log the slave command that just failed, with its round trip time.
+void logSlave(){
+  unsigned long rtt = (millis() - commsBegin) >> 2;
+  logEvent(LOG_SLAVE, commsDev | ((i2cRegisterMap[REG_SLAVESTAT] & 0x3) << 4), commsFrame[3], rtt > 255 ? 255 : rtt);
+}
+
+//Count the transaction that just ended, by its result in SLAVESTAT.
+void countLinkStat(){
+  uint16_t *stat = linkStat[commsDev];
+  uint8_t result = i2cRegisterMap[REG_SLAVESTAT] & 0x3;
+  unsigned long rtt;
+  uint8_t i;
+  if (result == SLAVE_OK) i = LINK_OK;
+  else if (result == SLAVE_ERR_TIMEOUT) i = LINK_TIMEOUT;
+  else i = LINK_FRAMING;
+  if (stat[LINK_TRIES] != 0xffff) stat[LINK_TRIES]++;
+  if (stat[i] != 0xffff) stat[i]++;
+  if (result == SLAVE_OK) {
+    rtt = micros() - commsSent;
+    stat[LINK_RTT] = rtt > 0xffff ? 0xffff : rtt;
   }
+}
 
-  //Enable input channels:
-  CDCTL0 |= (1u <<15);//V-
-  CDCTL0 |= (1u <<7);//V+
+//Copy the link quality counters of a slave into the LQ registers. Called from writeRegister(), so in the I2C interrupt
+//when it comes from the host.
+void readLinkStat(uint8_t val){
+  uint16_t *stat = linkStat[val & 0x3];
+  uint8_t i;
+  for (i=0;i<LINK_STATS;i++) {
+    i2cRegisterMap[REG_LQ_BASE + 2*i] = stat[i] & 0xff;
+    i2cRegisterMap[REG_LQ_BASE + 2*i + 1] = stat[i] >> 8;
+  }
+  if (val & 0x40) memset(stat, 0, LINK_STATS * sizeof(uint16_t));
+}
+
+//Start the slave command of batch entry batchIndex.
+void runBatchEntry(){
+  uint8_t *entry = &i2cRegisterMap[REG_BATCH_BASE + 3*batchIndex];
+  if (attCached(entry[0] & 0x3, entry[1], entry[2])) {
+    //The slave has this setting already.
+    commsAck = entry[2];
+    i2cRegisterMap[REG_SLAVESTAT] = SLAVE_OK;
+    batchEntryDone(0);
+    return;
+  }
+  runComms(entry[0] & 0x3, entry[1], entry[2]);
+}
+
+//Store the result of a batch entry, and go on with the next one right away.
+void batchEntryDone(int ret){
+  i2cRegisterMap[REG_BATCHRES_BASE + 2*batchIndex] = (ret == 0) ? commsAck : 0;
+  i2cRegisterMap[REG_BATCHRES_BASE + 2*batchIndex + 1] = i2cRegisterMap[REG_SLAVESTAT];
+  if (ret != 0) i2cRegisterMap[REG_BATCHCTL] |= 0x40;
+  batchIndex++;
+  if (batchIndex < batchCount) {
+    runBatchEntry();
+    return;
+  }
+  batchRunning = 0;
+  i2cRegisterMap[REG_BATCHCTL]&=~(0x80);
+}
+
+//Start a fan-out of COMMAND/ARG to the slaves in SLAVECTL bits [3:0].
+void startFanout(){
+  fanMask = i2cRegisterMap[4] & 0xf;
+  fanCommand = i2cRegisterMap[5];
+  fanArg = i2cRegisterMap[6];
+  fanDev = 0;
+  fanRunning = 1;
+  memset(&i2cRegisterMap[REG_FANRES_BASE], 0, REG_FANRES_END - REG_FANRES_BASE + 1);
+  i2cRegisterMap[4]&=~(1u << 6);
+  runFanEntry();
+}
+
+//Start the command to the next slave of the fan-out, or finish it.
+void runFanEntry(){
+  while (fanDev < 4 && !(fanMask & (1u << fanDev))) fanDev++;
+  if (fanDev == 4) {
+    fanRunning = 0;
+    shutdown_comparator();
+    i2cRegisterMap[4]&=~(1u << 7);
+    return;
+  }
+  if (attCached(fanDev, fanCommand, fanArg)) {
+    //The slave has this setting already.
+    commsAck = fanArg;
+    i2cRegisterMap[REG_SLAVESTAT] = SLAVE_OK;
+    fanEntryDone(0);
+    return;
+  }
+  runComms(fanDev, fanCommand, fanArg);
+}
+
+//Store the result of a fan-out slave, and go on with the next one right away.
+void fanEntryDone(int ret){
+  i2cRegisterMap[REG_FANRES_BASE + 2*fanDev] = (ret == 0) ? commsAck : 0;
+  i2cRegisterMap[REG_FANRES_BASE + 2*fanDev + 1] = i2cRegisterMap[REG_SLAVESTAT];
+  if (ret != 0) i2cRegisterMap[4] |= (1u << 6);
+  fanDev++;
+  runFanEntry();
+}
+
+//Set the signal to the bus multiplexer.
+void select_output(uint8_t dev){
+  write_comms_sel(commsSelect[dev & 0x3]);
+}
+
+
+//Same as above, just trying to make the code a bit smoother.
+void write_comms_sel(uint8_t sel){
+  uint8_t i;
+  for (i=0;i<2;i++) {
+    if (sel & (1u << i)) *selOut[i] |= selBit[i];
+    else *selOut[i] &= ~selBit[i];
+  }
+}
+
+//Comparator needs to be set up to receive return from the right slave:
+void setup_comparator(uint8_t dev){
+  //Select and enable both inputs in one write, which also clears the inputs of the slave before.
+  CDCTL0 = CDIMEN | CDIPEN | commsComparator[dev & 0x3];
   //Switch on comparator:
-  CDCTL1 |= (1u <<10);
+  CDCTL1 |= CDON;
 }
 
 void shutdown_comparator(){
   // End: Switch off comparator:
-  CDCTL1 &= ~(1u << 10);
+  CDCTL1 &= ~CDON;
   //Disable input:
-  CDCTL0 &= ~(1u <<15);//V-
-  CDCTL0 &= ~(1u <<7);//V+
+  CDCTL0 &= ~(CDIMEN | CDIPEN);
 }
 
-//We always expect 5 bytes back. This is used for the timeout. It works for now, needs to be updated if the comms protocol changes:
-const int expectedBytes_UART = 5;
-char c[expectedBytes_UART];
+//Non-blocking: returns 1 while still waiting, 0 on a good response, -1 on timeout or bad response.
+//The result is also left in SLAVESTAT.
 int waitForResponse(uint8_t dev){
-#if DEBUG_MODE
-  Serial.print("wait for response \n");
-#endif
-  memset(c, 0, sizeof(c));
-  //FIXME: Change this to look for a delimiter, rather then just the right number of bytes. Maybe both!
-  int timeout = Serial1.readBytes(c, expectedBytes_UART);
+  int b;
+  while ((b = Serial1.read()) >= 0) {
+    commsLastByte = millis();
+    //The first byte of the response ends the wait, and starts the parse.
+    if (nReceived == 0 && nSkipped == 0) {
+      latRecord(LAT_SLAVE_WAIT, latCommsMark);
+      latCommsMark = latNow();
+    }
+    if (nReceived == 0 && b != '!') {
+      if (++nSkipped > SLAVE_SYNC_MAX) return responseDone(SLAVE_ERR_FRAMING);
+      continue;
+    }
+    c[nReceived++] = b;
+    if ((nReceived == 2 && b != 'S' && b != 'L') || (nReceived == 3 && b != '!')) return responseDone(SLAVE_ERR_FRAMING);
+    //The length byte of a long response:
+    if (nReceived == 4 && c[1] == 'L') {
+      if (b > RESP_MAX) return responseDone(SLAVE_ERR_FRAMING);
+      nExpected = 4 + b + 1;
+    }
+    if (nReceived == nExpected) {
+      if (b != SLAVE_TRAILER) return responseDone(SLAVE_ERR_TRAILER);
+      //Incoming response from slave
+      commsAck = (c[1] != 'L') ? c[3] : (c[3] ? c[4] : 0);
+      return responseDone(SLAVE_OK);
+    }
+  }
+  if (nReceived == 0) {
+    if (millis() - commsStart >= slaveTimeoutMs) return responseDone(SLAVE_ERR_TIMEOUT);
+  } else {
+    if (millis() - commsLastByte >= slaveGapMs) return responseDone(SLAVE_ERR_TIMEOUT);
+  }
+  return 1;
+}
+
+int responseDone(uint8_t result){
 #if DEBUG_MODE
   Serial.print("Received: ");
   Serial.print(c[0]);
   Serial.print(c[1]);
   Serial.print(c[2]);
   Serial.print(c[3]);
+  Serial.print(", result ");
+  Serial.println(result);
 #endif
-  if(c[0]=='!' && c[1]=='S' && c[2]=='!'){//Incoming response from slave
-    i2cRegisterMap[7] = c[3];
-    return 0;
-  }
-  else{
-    return -1;
-  }
+  i2cRegisterMap[REG_SLAVESTAT] = result;
+  //A timeout without any response byte is still part of the wait.
+  latRecord((nReceived || nSkipped) ? LAT_SLAVE_PARSE : LAT_SLAVE_WAIT, latCommsMark);
+  return result == SLAVE_OK ? 0 : -1;
 }
 
 
-
@@ -0,0 +1,11 @@
+//The command line library. The simulation has no debug terminal, so commands are registered and never run.
+#ifndef SIM_CMD_H
+#define SIM_CMD_H
+
+#include "Energia.h"
+
+void cmdInit(uint32_t speed);
+void cmdPoll(void);
+void cmdAdd(const char *name, int (*func)(int argc, char **argv));
+
+#endif
@@ -0,0 +1,118 @@
+//The parts of the Energia core arafe_master.ino uses, on top of the simulated hardware in sim.cpp.
+#ifndef SIM_ENERGIA_H
+#define SIM_ENERGIA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "msp430.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define NOT_ON_ADC 0xFF
+#define P3_4 21
+#define TEMPSENSOR 138
+
+//Where the firmware keeps its non-volatile data: the simulated info section.
+extern uint8_t simFram[256];
+//The temperature sensor calibration of the device TLV, see sim.h.
+extern uint16_t simTlvAdc[2];
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+uint8_t digitalRead(uint8_t pin);
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+uint8_t digitalPinToADCIn(uint8_t pin);
+volatile uint8_t *portOutputRegister(uint8_t port);
+volatile uint8_t *portDirRegister(uint8_t port);
+volatile uint8_t *portInputRegister(uint8_t port);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(unsigned int us);
+void wakeup(void);
+extern volatile boolean stay_asleep;
+
+//Interrupt handlers (TB2 overflow, Serial1 receive, I2C, ADC) wait for GIE like the real ones.
+void sim_set_gie(bool on);
+uint16_t sim_get_sr(void);
+void sim_bis_sr(uint16_t bits);
+void sim_bic_sr_on_exit(uint16_t bits);
+#define __get_SR_register() sim_get_sr()
+#define __bis_SR_register(x) sim_bis_sr(x)
+#define __bic_SR_register_on_exit(x) sim_bic_sr_on_exit(x)
+#define __disable_interrupt() sim_set_gie(false)
+#define __enable_interrupt() sim_set_gie(true)
+#define noInterrupts() sim_set_gie(false)
+#define interrupts() sim_set_gie(true)
+//Interrupt handlers are called by sim.cpp.
+#define interrupt(vector) unused
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const uint8_t *buf, size_t len);
+  size_t write(const char *s) { return write((const uint8_t *) s, strlen(s)); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(unsigned char v, int base = DEC) { return print((unsigned long) v, base); }
+  size_t print(int v, int base = DEC) { return print((long) v, base); }
+  size_t print(unsigned int v, int base = DEC) { return print((unsigned long) v, base); }
+  size_t print(long v, int base = DEC);
+  size_t print(unsigned long v, int base = DEC);
+  size_t println(void) { return write("\r\n"); }
+  template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  template <typename T> size_t println(T v, int base) { size_t n = print(v, base); return n + println(); }
+};
+
+class Stream : public Print {
+public:
+  Stream() : timeout(1000) {}
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual int peek(void) = 0;
+  virtual void flush(void) = 0;
+  void setTimeout(unsigned long ms) { timeout = ms; }
+  size_t readBytes(char *buf, size_t len);
+  using Print::write;
+protected:
+  unsigned long timeout;
+};
+
+//Energia's UART: a 16 byte receive buffer, filled by the receive interrupt.
+#define SERIAL_BUFFER_SIZE 16
+class HardwareSerial : public Stream {
+public:
+  HardwareSerial(uint8_t n) : port(n), baud(0), head(0), tail(0) {}
+  void begin(unsigned long b);
+  void end(void) {}
+  int available(void) { return (SERIAL_BUFFER_SIZE + head - tail) % SERIAL_BUFFER_SIZE; }
+  int read(void);
+  int peek(void) { return head == tail ? -1 : rx[tail]; }
+  void flush(void) {}
+  size_t write(uint8_t c);
+  using Print::write;
+  operator bool() { return true; }
+  //For sim.cpp: a byte has come in.
+  void receive(uint8_t c);
+  uint8_t port;
+  unsigned long baud;
+private:
+  uint8_t rx[SERIAL_BUFFER_SIZE];
+  uint8_t head, tail;
+};
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif
@@ -0,0 +1,954 @@
+//Latency benchmark for arafe_master.ino on the simulated board.
+//Every figure is given twice: in simulated time (what the firmware would take on the board, by the model in sim.cpp),
+//and in host time per operation (how much firmware code runs for it, useful to compare builds with each other).
+//Exits with 1 if the firmware did not do what it was asked.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include "sim.h"
+#include "regs.h"
+
+//From the Energia core of the sketch.
+unsigned long millis(void);
+int cmdBinary(int argc, char **argv);
+extern uint8_t serialBinary;
+void calLoad(void);
+extern uint8_t simFram[256];
+
+//Registers without a name in the sketch.
+#define REG_POWERCTL 0
+#define REG_MONCTL 2
+#define REG_SLAVECTL 4
+#define REG_COMMAND 5
+#define REG_ACK 7
+#define REG_POWERDFLT 1
+//Size of a config record (config_t) in FRAM.
+#define CONFIG_SIZE 56
+
+static int failures;
+
+static void check(bool ok, const char *what){
+  if (ok) return;
+  printf("FAIL: %s\n", what);
+  failures++;
+}
+
+static double hostNs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct stat_t {
+  unsigned long n, min, max;
+  double sum, host;
+} stat_t;
+
+static void statAdd(stat_t *s, unsigned long us){
+  if (!s->n || us < s->min) s->min = us;
+  if (us > s->max) s->max = us;
+  s->sum += us;
+  s->n++;
+}
+
+static void statPrint(const char *name, const stat_t *s){
+  printf("  %-28s %6lu %10.1f %10lu %10lu %12.0f\n", name, s->n, s->n ? s->sum / s->n : 0.0, s->min, s->max,
+         s->n ? s->host / s->n : 0.0);
+}
+
+static void header(const char *title){
+  printf("\n%s\n  %-28s %6s %10s %10s %10s %12s\n", title, "", "n", "mean us", "min us", "max us", "host ns/op");
+}
+
+//Run loop() until the firmware clears mask in reg. Returns the simulated time it took, or 0 on timeout.
+static unsigned long waitClear(uint8_t reg, uint8_t mask, unsigned long timeout){
+  unsigned long start = simTime();
+  while (simPeek(reg) & mask) {
+    if (simTime() - start > timeout) return 0;
+    simLoop();
+  }
+  return simTime() - start;
+}
+
+//Start the measurement at a random point of the millisecond, like a host that is not synchronized to the board.
+static void randomPhase(void){
+  simRunFor(1000 + rand() % 1000);
+}
+
+static void benchRegisters(const char *speed, unsigned long bit){
+  const int n = 20000;
+  char title[48];
+  stat_t s;
+  uint8_t buf[REG_MAX];
+  unsigned long stretch;
+  int i;
+  simI2cBit = bit;
+  snprintf(title, sizeof(title), "Register access (I2C at %s)", speed);
+  header(title);
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    unsigned long t = simTime();
+    double h = hostNs();
+    simI2cWriteReg(REG_BATCH_BASE + i % 24, i);
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  check(simPeek(REG_BATCH_BASE + (n - 1) % 24) == (uint8_t) (n - 1), "register write");
+  statPrint("single register write", &s);
+
+  memset(&s, 0, sizeof(s));
+  stretch = simI2cStretch;
+  for (i=0;i<n;i++) {
+    unsigned long t = simTime();
+    double h = hostNs();
+    simI2cRead(REG_BATCH_BASE, buf, 16);
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  check(buf[1] == simPeek(REG_BATCH_BASE + 1), "burst read");
+  statPrint("16 byte burst read", &s);
+  printf("  %-28s %17.0f ns per read\n", "  SCL held low", (double) (simI2cStretch - stretch) / n);
+
+  //The whole register map in one read, from the middle so it wraps.
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n/10;i++) {
+    unsigned long t = simTime();
+    double h = hostNs();
+    simI2cRead(REG_MAX / 2, buf, REG_MAX);
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  //MONSEQ moves on at the stop condition, when the scan that finished during the read is published.
+  for (i=0;i<REG_MAX;i++) {
+    if ((REG_MAX / 2 + i) % REG_MAX != REG_MONSEQ) check(buf[i] == simPeek((REG_MAX / 2 + i) % REG_MAX), "register map read");
+  }
+  statPrint("register map read", &s);
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    unsigned long t = simTime();
+    double h = hostNs();
+    simI2cWriteReg(REG_SNAPCTL, 0x80);
+    simI2cRead(REG_SNAPCTL, buf, 15);
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  check(buf[0] == 0 && buf[12] == simPeek(REG_SNAP_BASE + 11), "telemetry snapshot");
+  statPrint("snapshot latch and read", &s);
+}
+
+//Time from the end of the write that sets bit 7 to the firmware clearing it.
+static void benchDispatch(const char *name, uint8_t reg, uint8_t val){
+  const int n = 500;
+  stat_t s;
+  int i;
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    unsigned long us;
+    double h;
+    randomPhase();
+    simI2cWriteReg(reg, val);
+    h = hostNs();
+    us = waitClear(reg, 0x80, 1000000);
+    s.host += hostNs() - h;
+    check(us != 0, name);
+    statAdd(&s, us);
+  }
+  statPrint(name, &s);
+}
+
+//One slave command, from the end of the SLAVECTL write to SLAVECTL bit 7 clearing.
+static unsigned long slaveCommand(uint8_t dev, uint8_t command, uint8_t arg, stat_t *s){
+  uint8_t cmd[3] = {REG_COMMAND, command, arg};
+  unsigned long us;
+  double h;
+  simI2cWrite(cmd, 3);
+  simI2cWriteReg(REG_SLAVECTL, 0x80 | dev);
+  h = hostNs();
+  us = waitClear(REG_SLAVECTL, 0x80, 5000000);
+  s->host += hostNs() - h;
+  statAdd(s, us);
+  return us;
+}
+
+static void benchSlave(void){
+  static const char *baudName[5] = {"9600", "19200", "38400", "57600", "115200"};
+  const int n = 200;
+  char name[40];
+  stat_t s;
+  uint8_t baud;
+  uint8_t dev;
+  int i;
+  header("Slave command round trip (slave turnaround 2ms)");
+  for (baud=0;baud<5;baud++) {
+    simI2cWriteReg(REG_LINKCTL, 0x80 | baud);
+    check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL");
+    memset(&s, 0, sizeof(s));
+    for (i=0;i<n;i++) {
+      dev = i % 4;
+      randomPhase();
+      slaveCommand(dev, i % 8, i % 128, &s);
+      check(simPeek(REG_ACK) == i % 128 && !(simPeek(REG_SLAVECTL) & 0x40), "slave command");
+      check(simPeek(REG_RESPLEN) == 1 && simPeek(REG_RESP_BASE) == i % 128, "short response in the mailbox");
+    }
+    snprintf(name, sizeof(name), "command at %s baud", baudName[baud]);
+    statPrint(name, &s);
+  }
+
+  //A rate that does not exist and a timeout of 0: the rate in use stays, and LINKCTL and TIMEOUT show what is applied.
+  simI2cWriteReg(REG_TIMEOUT, 0);
+  simI2cWriteReg(REG_LINKCTL, 0x87);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL");
+  check(simPeek(REG_LINKCTL) == 0x04 && simUartBaud(1) > 110000, "LINKCTL rate above 4 refused");
+  check(simPeek(REG_TIMEOUT) == 1, "TIMEOUT 0 applied as 1");
+  simI2cWriteReg(REG_TIMEOUT, 100);
+  simI2cWriteReg(REG_LINKCTL, 0x84);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL");
+
+  //At 115200 from here on.
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    randomPhase();
+    simSlaveFault(1, SIM_SLAVE_SILENT, 1);
+    slaveCommand(1, i % 8, i % 128, &s);
+    check(simPeek(REG_ACK) == i % 128 && (simPeek(REG_SLAVESTAT) & 0x70) == 0x10, "retry after a lost reply");
+  }
+  statPrint("command, one lost reply", &s);
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    randomPhase();
+    simSlaveFault(2, SIM_SLAVE_BAD_HEADER, 1);
+    slaveCommand(2, i % 8, i % 128, &s);
+    check(simPeek(REG_ACK) == i % 128 && (simPeek(REG_SLAVESTAT) & 0x70) == 0x10, "retry after a bad reply");
+  }
+  statPrint("command, one bad reply", &s);
+
+  //A slave that answers within the millisecond: the board has to be awake to switch the comparator in time.
+  memset(&s, 0, sizeof(s));
+  for (dev=0;dev<4;dev++) simSlave[dev].turnaround = 100;
+  for (i=0;i<n;i++) {
+    randomPhase();
+    slaveCommand(i % 4, i % 8, i % 128, &s);
+    check(simPeek(REG_ACK) == i % 128 && (simPeek(REG_SLAVESTAT) & 0x73) == 0, "slave turnaround 100us");
+  }
+  for (dev=0;dev<4;dev++) simSlave[dev].turnaround = 2000;
+  statPrint("command, turnaround 100us", &s);
+
+  //All 8 attenuator settings of a slave in one long response, read from the mailbox in one burst.
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    uint8_t buf[1 + 32];
+    dev = i % 4;
+    randomPhase();
+    slaveCommand(dev, SIM_SLAVE_READBACK, 0, &s);
+    simI2cRead(REG_RESPLEN, buf, sizeof(buf));
+    check(!(simPeek(REG_SLAVECTL) & 0x40) && buf[0] == 8 && !memcmp(buf + 1, simSlave[dev].setting, 8) && !buf[9],
+          "readback into the response mailbox");
+  }
+  statPrint("readback of 8 settings", &s);
+
+  //Eight commands as a batch, and fanned out to all four slaves.
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    uint8_t batch[25];
+    unsigned long t;
+    double h;
+    int k;
+    batch[0] = REG_BATCH_BASE;
+    for (k=0;k<8;k++) {
+      batch[1 + 3*k] = k % 4;
+      batch[2 + 3*k] = k;
+      batch[3 + 3*k] = (i + k) % 128;
+    }
+    randomPhase();
+    simI2cWrite(batch, 25);
+    simI2cWriteReg(REG_BATCHCTL, 0x88);
+    t = simTime();
+    h = hostNs();
+    check(waitClear(REG_BATCHCTL, 0x80, 10000000) != 0 && !(simPeek(REG_BATCHCTL) & 0x40), "batch");
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  statPrint("batch of 8 commands", &s);
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    uint8_t cmd[3] = {REG_COMMAND, (uint8_t) (i % 8), (uint8_t) (i % 128)};
+    unsigned long t;
+    double h;
+    randomPhase();
+    simI2cWrite(cmd, 3);
+    simI2cWriteReg(REG_SLAVECTL, 0xAF);
+    t = simTime();
+    h = hostNs();
+    check(waitClear(REG_SLAVECTL, 0x80, 10000000) != 0 && !(simPeek(REG_SLAVECTL) & 0x40), "fan-out");
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+    for (dev=0;dev<4;dev++) check(simPeek(REG_FANRES_BASE + 2*dev) == i % 128, "fan-out result");
+  }
+  statPrint("fan-out to 4 slaves", &s);
+
+  //SLAVECTL and BATCHCTL written before loop() gets to either: the batch runs after the command.
+  {
+    uint8_t cmd[4] = {REG_BATCH_BASE, 1, 2, 0x55};
+    uint8_t slave[3] = {REG_COMMAND, 1, 0x33};
+    unsigned long passes = 0;
+    unsigned long t;
+    simI2cWrite(cmd, 4);
+    simI2cWrite(slave, 3);
+    simI2cWriteReg(REG_SLAVECTL, 0x82);
+    simI2cWriteReg(REG_BATCHCTL, 0x81);
+    check(waitClear(REG_SLAVECTL, 0x80, 5000000) != 0 && simPeek(REG_ACK) == 0x33, "SLAVECTL next to BATCHCTL");
+    check(waitClear(REG_BATCHCTL, 0x80, 5000000) != 0 && simPeek(REG_BATCHRES_BASE) == 0x55 &&
+          !(simPeek(REG_BATCHCTL) & 0x40), "BATCHCTL next to SLAVECTL");
+
+    //A batch cancelled while a command is in flight never runs, and loop() goes back to sleep.
+    simI2cWrite(slave, 3);
+    simI2cWriteReg(REG_SLAVECTL, 0x82);
+    simLoop();
+    simI2cWriteReg(REG_BATCHCTL, 0x81);
+    simI2cWriteReg(REG_BATCHCTL, 0x00);
+    check(waitClear(REG_SLAVECTL, 0x80, 5000000) != 0, "SLAVECTL");
+    t = simTime();
+    while (simTime() - t < 100000) {
+      simLoop();
+      passes++;
+    }
+    check(simPeek(REG_BATCHRES_BASE) == 0x55 && simPeek(REG_BATCHCTL) == 0x00, "cancelled BATCHCTL");
+    check(passes < 500, "loop() sleeps after a cancelled BATCHCTL");
+    printf("  %-28s %6lu passes of loop() in 100ms\n", "after a cancelled batch", passes);
+  }
+
+  //A slave that clamps the argument: the cache keeps what it acknowledged, so only that is skipped.
+  {
+    unsigned long frames;
+    simI2cWriteReg(REG_ATTCTL, 0x3);
+    simSlave[1].clamp = 100;
+    slaveCommand(1, 0, 120, &s);
+    check(simPeek(REG_ACK) == 100 && simSlave[1].setting[0] == 100, "clamped attenuator setting");
+    frames = simSlave[1].frames;
+    slaveCommand(1, 0, 120, &s);
+    check(simSlave[1].frames == frames + 1 && simPeek(REG_ACK) == 100, "clamped setting sent again");
+    slaveCommand(1, 0, 100, &s);
+    check(simSlave[1].frames == frames + 1 && simPeek(REG_ACK) == 100, "acknowledged setting skipped");
+    simSlave[1].clamp = 0;
+    simI2cWriteReg(REG_ATTCTL, 0x1);
+  }
+}
+
+//Switch the clock profile, and check that the CARRIER and the UARTs still run at their rates.
+static void setClock(uint8_t profile){
+  double carrier = simCarrierHz();
+  simI2cWriteReg(REG_CLKCTL, 0x80 | profile);
+  check(waitClear(REG_CLKCTL, 0x80, 1000000) != 0 && simPeek(REG_CLKCTL) == profile, "CLKCTL");
+  check(simCarrierHz() == carrier, "CARRIER frequency after a clock change");
+  check(simUartBaud(0) > 9600 * 0.98 && simUartBaud(0) < 9600 * 1.02, "debug port baud rate after a clock change");
+  check(simUartBaud(1) > 115200 * 0.98 && simUartBaud(1) < 115200 * 1.02, "slave link baud rate after a clock change");
+}
+
+static void benchClock(void){
+  static const char *profileName[3] = {"16MHz", "low CPU", "low power"};
+  const int n = 200;
+  char name[40];
+  stat_t s;
+  uint8_t profile;
+  unsigned long ms;
+  unsigned long stretch;
+  int i;
+  header("Clock profiles (slave link at 115200, CARRIER 250kHz)");
+  //CARRIER 1 (4MHz) is too fast for 1MHz SMCLK: the profile is refused.
+  simI2cWriteReg(REG_CLKCTL, 0x82);
+  check(waitClear(REG_CLKCTL, 0x80, 1000000) != 0 && simPeek(REG_CLKCTL) == 0x20, "CLKCTL refuses a CARRIER it cannot make");
+  simI2cWriteReg(REG_CARRIER, 31);
+  simI2cWriteReg(REG_LINKCTL, 0x84);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL");
+
+  for (profile=0;profile<3;profile++) {
+    setClock(profile);
+    //millis() has to keep the same pace.
+    ms = millis();
+    simRunFor(1000000);
+    ms = millis() - ms;
+    check(ms >= 999 && ms <= 1001, "millis() pace");
+    snprintf(name, sizeof(name), "MONCTL at %s", profileName[profile]);
+    benchDispatch(name, REG_MONCTL, 0x81);
+    memset(&s, 0, sizeof(s));
+    for (i=0;i<n;i++) {
+      randomPhase();
+      slaveCommand(i % 4, i % 8, i % 128, &s);
+      check(simPeek(REG_ACK) == i % 128 && !(simPeek(REG_SLAVECTL) & 0x40), "slave command");
+    }
+    snprintf(name, sizeof(name), "command at %s", profileName[profile]);
+    statPrint(name, &s);
+    //At 400kHz the I2C interrupt has 22.5us per byte.
+    memset(&s, 0, sizeof(s));
+    simI2cBit = 2500;
+    stretch = simI2cStretch;
+    for (i=0;i<n;i++) {
+      uint8_t buf[16];
+      unsigned long t = simTime();
+      double h = hostNs();
+      simI2cRead(REG_BATCH_BASE, buf, 16);
+      s.host += hostNs() - h;
+      statAdd(&s, simTime() - t);
+    }
+    simI2cBit = 10000;
+    snprintf(name, sizeof(name), "400kHz read, %s", profileName[profile]);
+    statPrint(name, &s);
+    printf("  %-28s %17.0f ns per read\n", "  SCL held low", (double) (simI2cStretch - stretch) / n);
+  }
+
+  setClock(0);
+  simI2cWriteReg(REG_CARRIER, 1);
+  simI2cWriteReg(REG_LINKCTL, 0x84);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL");
+}
+
+//Apply new I2C addresses. The write goes to the address in use, the apply happens after it.
+static void setAddress(uint8_t address, uint8_t group, uint8_t ctl){
+  uint8_t buf[4] = {REG_ADDRCTL, (uint8_t) (0x80 | ctl), address, group};
+  simI2cWrite(buf, 4);
+  check(waitClear(REG_ADDRCTL, 0x80, 1000000) != 0, "ADDRCTL");
+}
+
+//A board on its own address, its group address and the general call.
+static void benchAddress(void){
+  const int n = 200;
+  stat_t s;
+  uint8_t count;
+  uint8_t buf[4];
+  int i;
+  header("I2C addresses (broadcast to group address 31, at 100kHz)");
+  setAddress(40, 31, 0x3);
+  check(simPeek(REG_ADDRCTL) == 0x3, "ADDRCTL applied");
+  check(simI2cRead(REG_I2CADDR, buf, 1) == 0, "old address NACKed");
+  simI2cAddress = 40;
+  check(simI2cReadReg(REG_I2CADDR) == 40, "new address");
+  count = simPeek(REG_BCCOUNT);
+
+  //Reads from the group address leave SDA alone.
+  simI2cAddress = 31;
+  simI2cRead(REG_I2CADDR, buf, 4);
+  check(buf[0] == 0xFF && buf[3] == 0xFF, "group address read");
+  //The addresses cannot be broadcast.
+  buf[0] = REG_I2CADDR;
+  buf[1] = 50;
+  simI2cWrite(buf, 2);
+  check(simPeek(REG_I2CADDR) == 40, "broadcast write to I2CADDR");
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    uint8_t cmd[4] = {REG_SLAVECTL, (uint8_t) (0x80 | i % 4), (uint8_t) (i % 8), (uint8_t) (i % 128)};
+    unsigned long t;
+    double h;
+    randomPhase();
+    simI2cAddress = 31;
+    simI2cWrite(cmd, 4);
+    t = simTime();
+    h = hostNs();
+    check(waitClear(REG_SLAVECTL, 0x80, 5000000) != 0, "broadcast slave command");
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+    //Results come from the own address.
+    simI2cAddress = 40;
+    check(simI2cReadReg(REG_ACK) == i % 128, "broadcast slave command result");
+  }
+  statPrint("broadcast slave command", &s);
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    unsigned long t;
+    double h;
+    randomPhase();
+    simI2cAddress = 0;
+    simI2cWriteReg(REG_POWERCTL, 0x8f);
+    t = simTime();
+    h = hostNs();
+    check(waitClear(REG_POWERCTL, 0x80, 1000000) != 0, "general call POWERCTL");
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  statPrint("general call POWERCTL", &s);
+  simI2cAddress = 40;
+  //The pointer write of the group read counts too.
+  check(simPeek(REG_BCCOUNT) == (uint8_t) (count + 2 + 2 * n), "BCCOUNT");
+
+  //A reserved address is refused, and the old ones stay.
+  setAddress(0x7A, 31, 0x3);
+  check(simPeek(REG_ADDRCTL) == 0x23 && simPeek(REG_I2CADDR) == 40, "reserved address refused");
+  check(simI2cReadReg(REG_I2CADDR) == 40, "address after a refused apply");
+
+  setAddress(30, 31, 0);
+  simI2cAddress = 30;
+  check(simI2cReadReg(REG_ADDRCTL) == 0, "back to address 30");
+}
+
+//Binary mode of the debug port, as the host sees it: SLIP frames, CRC16 CCITT over the bytes before it.
+typedef struct bin_reply_t {
+  uint8_t seq, op, status, reg, len;
+  uint8_t data[64];
+  bool crc;
+} bin_reply_t;
+
+static uint16_t binCrc(uint16_t crc, uint8_t data){
+  int i;
+  crc ^= (uint16_t) data << 8;
+  for (i=0;i<8;i++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+  return crc;
+}
+
+static void binEscape(uint8_t *out, uint16_t *n, uint8_t data){
+  if (data == 0xC0 || data == 0xDB) {
+    out[(*n)++] = 0xDB;
+    out[(*n)++] = data == 0xC0 ? 0xDC : 0xDD;
+  } else {
+    out[(*n)++] = data;
+  }
+}
+
+//Append a request to out. With bad set, the CRC does not match.
+static void binRequest(uint8_t *out, uint16_t *n, uint8_t seq, uint8_t op, uint8_t reg, uint8_t len,
+                       const uint8_t *data, bool bad){
+  uint8_t head[4] = {seq, op, reg, len};
+  uint16_t crc = 0xFFFF;
+  int i;
+  out[(*n)++] = 0xC0;
+  for (i=0;i<4;i++) {
+    crc = binCrc(crc, head[i]);
+    binEscape(out, n, head[i]);
+  }
+  for (i=0;op==2 && i<len;i++) {
+    crc = binCrc(crc, data[i]);
+    binEscape(out, n, data[i]);
+  }
+  if (bad) crc ^= 0x0100;
+  binEscape(out, n, crc & 0xff);
+  binEscape(out, n, crc >> 8);
+  out[(*n)++] = 0xC0;
+}
+
+//Run loop() until count replies have come back, or timeout. Returns how many did.
+static int binReplies(bin_reply_t *r, int count, unsigned long timeout){
+  static uint8_t frame[80];
+  uint8_t buf[64];
+  unsigned long start = simTime();
+  uint16_t n, i, j;
+  uint16_t crc;
+  int got = 0;
+  bool esc = false;
+  uint8_t len = 0;
+  while (got < count && simTime() - start < timeout) {
+    simLoop();
+    n = simDebugReceive(buf, sizeof(buf));
+    for (i=0;i<n && got<count;i++) {
+      if (buf[i] == 0xC0) {
+        if (len >= 7) {
+          crc = 0xFFFF;
+          for (j=0;j<len-2;j++) crc = binCrc(crc, frame[j]);
+          r[got].seq = frame[0];
+          r[got].op = frame[1];
+          r[got].status = frame[2];
+          r[got].reg = frame[3];
+          r[got].len = frame[4];
+          memcpy(r[got].data, frame + 5, len - 7 < 64 ? len - 7 : 64);
+          r[got].crc = crc == (frame[len-2] | (frame[len-1] << 8)) && frame[4] == len - 7;
+          got++;
+        }
+        len = 0;
+      } else if (buf[i] == 0xDB) {
+        esc = true;
+      } else {
+        if (len < sizeof(frame)) frame[len++] = esc ? (buf[i] == 0xDC ? 0xC0 : 0xDB) : buf[i];
+        esc = false;
+      }
+    }
+  }
+  return got;
+}
+
+static bool binReply(const bin_reply_t *r, uint8_t seq, uint8_t op, uint8_t status){
+  return r->crc && r->seq == seq && r->op == (0x80 | op) && r->status == status;
+}
+
+//"bin" and a round trip of every kind of request. The pipelined requests go out back to back, far more than the 16
+//byte receive buffer holds, with 0xC0 and 0xDB in sequence numbers and data that have to be escaped both ways.
+static void benchBinary(void){
+  const int n = 200;
+  static uint8_t out[256];
+  char cmd[] = "bin";
+  char *argv[1] = {cmd};
+  bin_reply_t r[8];
+  uint8_t timeout = simPeek(REG_TIMEOUT);
+  uint8_t c0 = 0xC0, db = 0xDB, bad = 0x22;
+  uint8_t buf[16];
+  uint16_t len;
+  stat_t s;
+  int i;
+  header("Debug port binary mode (115200)");
+  cmdBinary(1, argv);
+  check(serialBinary != 0, "bin");
+  simRunFor(1000);
+  while (simDebugReceive(buf, sizeof(buf)));
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    unsigned long t;
+    double h;
+    randomPhase();
+    len = 0;
+    binRequest(out, &len, i, 1, REG_BATCH_BASE, 16, NULL, false);
+    t = simTime();
+    h = hostNs();
+    simDebugSend(out, len);
+    check(binReplies(r, 1, 100000) == 1 && binReply(r, i, 1, 0) && r[0].len == 16, "binary read");
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+  }
+  simI2cRead(REG_BATCH_BASE, buf, 16);
+  check(!memcmp(r[0].data, buf, 16), "binary read data");
+  statPrint("read 16 registers", &s);
+
+  len = 0;
+  binRequest(out, &len, 0xC0, 2, REG_TIMEOUT, 1, &c0, false);
+  binRequest(out, &len, 0xDB, 1, REG_TIMEOUT, 1, NULL, false);
+  binRequest(out, &len, 3, 2, REG_TIMEOUT, 1, &bad, true);
+  binRequest(out, &len, 4, 7, REG_TIMEOUT, 1, NULL, false);
+  binRequest(out, &len, 5, 1, REG_MAX - 2, 4, NULL, false);
+  binRequest(out, &len, 6, 2, REG_TIMEOUT, 1, &db, false);
+  binRequest(out, &len, 7, 1, REG_TIMEOUT, 1, NULL, false);
+  simDebugSend(out, len);
+  check(binReplies(r, 7, 100000) == 7, "pipelined requests all answered");
+  check(binReply(&r[0], 0xC0, 2, 0), "write 0xC0");
+  check(binReply(&r[1], 0xDB, 1, 0) && r[1].len == 1 && r[1].data[0] == 0xC0, "read back 0xC0");
+  check(binReply(&r[2], 3, 2, 1), "CRC error");
+  check(binReply(&r[3], 4, 7, 3), "unknown op");
+  check(binReply(&r[4], 5, 1, 2), "read past the register map");
+  check(binReply(&r[5], 6, 2, 0), "write 0xDB");
+  check(binReply(&r[6], 7, 1, 0) && r[6].len == 1 && r[6].data[0] == 0xDB, "read back 0xDB");
+  printf("  7 requests, %u bytes back to back: answered in order, CRC error, op and range refused\n", len);
+
+  len = 0;
+  binRequest(out, &len, 8, 2, REG_TIMEOUT, 1, &timeout, false);
+  binRequest(out, &len, 9, 3, 0, 0, NULL, false);
+  simDebugSend(out, len);
+  check(binReplies(r, 2, 100000) == 2 && binReply(&r[0], 8, 2, 0) && binReply(&r[1], 9, 3, 0), "binary exit");
+  check(!serialBinary && simUartBaud(0) > 9600 * 0.98 && simUartBaud(0) < 9600 * 1.02, "back to the command shell");
+}
+
+//A current spike after STATCNT has stopped still shows in STATMAX.
+static void benchStatistics(void){
+  uint8_t buf[10];
+  unsigned long rate;
+  unsigned long start;
+  printf("\nStatistics of CUR0\n");
+  //Conversions of CUR0 in a second, then long enough for 65535 of them.
+  simI2cWriteReg(REG_STATCTL, 0x81);
+  check(waitClear(REG_STATCTL, 0x80, 100000) != 0, "STATCTL");
+  simRunFor(1000000);
+  simI2cWriteReg(REG_STATCTL, 0x81);
+  check(waitClear(REG_STATCTL, 0x80, 100000) != 0, "STATCTL");
+  simI2cRead(REG_STAT_BASE + 8, buf, 2);
+  rate = buf[0] | (buf[1] << 8);
+  check(rate > 0, "CUR0 conversions");
+  if (!rate) return;
+  start = simTime();
+  simRunFor(70000 / rate * 1000000);
+  simSetAnalog(17, 0x180);
+  simRunFor(20000);
+  simSetAnalog(17, 0x100);
+  simRunFor(20000);
+  simI2cWriteReg(REG_STATCTL, 0x81);
+  check(waitClear(REG_STATCTL, 0x80, 100000) != 0, "STATCTL");
+  simI2cRead(REG_STAT_BASE, buf, 10);
+  check((buf[8] | (buf[9] << 8)) == 0xffff, "STATCNT stops at 65535");
+  check((buf[4] | (buf[5] << 8)) == 0x180, "STATMAX after STATCNT has stopped");
+  check((buf[6] | (buf[7] << 8)) == 0x100 << 6, "STATMEAN of the first 65535 conversions");
+  printf("  %lu conversions a second, spike after %.1f s: STATMAX 0x%03x\n", rate, (simTime() - start) / 1e6,
+         buf[4] | (buf[5] << 8));
+}
+
+//Event seq of the log into buf: time, type and data, as in LOGENTRY. Returns LOGCTL.
+static uint8_t readLogEntry(uint16_t seq, uint8_t *buf){
+  uint8_t cur[3] = {REG_LOGCUR, (uint8_t) (seq & 0xff), (uint8_t) (seq >> 8)};
+  simI2cWrite(cur, 3);
+  simI2cWriteReg(REG_LOGCTL, 0x80);
+  simI2cRead(REG_LOGENTRY_BASE, buf, 6);
+  return simI2cReadReg(REG_LOGCTL);
+}
+
+//CUR0 steps over its threshold at a random point of the scan: time until slave 0 has no power, and POWERCTL and
+//TRIPSTAT show the trip.
+static void benchTrip(void){
+  stat_t s;
+  int i;
+  unsigned long t;
+  double h;
+  header("Overcurrent trip (CUR0 0x100 to 0x300, TRIPTHR0 0x200)");
+  memset(&s, 0, sizeof(s));
+  simI2cWriteReg(REG_TRIPTHR_BASE, 0x00);
+  simI2cWriteReg(REG_TRIPTHR_BASE + 1, 0x02);
+  simI2cWriteReg(REG_TRIPCTL, 0x01);
+  for (i=0;i<100;i++) {
+    simI2cWriteReg(REG_TRIPSTAT, 0);
+    simI2cWriteReg(REG_POWERCTL, 0x8f);
+    check(waitClear(REG_POWERCTL, 0x80, 10000000) != 0 && simSlavePowered(0), "power on after trip");
+    randomPhase();
+    t = simTime();
+    h = hostNs();
+    simSetAnalog(17, 0x300);
+    while (simSlavePowered(0) && simTime() - t < 100000) simRunFor(1);
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+    simSetAnalog(17, 0x100);
+    simRunFor(1000);
+    check(!simSlavePowered(0) && !(simPeek(REG_POWERCTL) & 0x1) && simPeek(REG_TRIPSTAT) == 0x01, "CUR0 trip");
+  }
+  check(s.max < 1000, "trip within a millisecond");
+  statPrint("CUR0 above TRIPTHR0", &s);
+
+  //A batch and a fan-out to the slaves still powered, all good: the trip is still the last event in the log.
+  {
+    uint8_t batch[25];
+    uint8_t cmd[3] = {REG_COMMAND, 1, 0x11};
+    uint8_t entry[6];
+    uint16_t seq;
+    batch[0] = REG_BATCH_BASE;
+    for (i=0;i<8;i++) {
+      batch[1 + 3*i] = 1 + i % 3;
+      batch[2 + 3*i] = i;
+      batch[3 + 3*i] = i;
+    }
+    simI2cWrite(batch, 25);
+    simI2cWriteReg(REG_BATCHCTL, 0x88);
+    check(waitClear(REG_BATCHCTL, 0x80, 10000000) != 0 && !(simPeek(REG_BATCHCTL) & 0x40), "batch after a trip");
+    simI2cWrite(cmd, 3);
+    simI2cWriteReg(REG_SLAVECTL, 0xAE);
+    check(waitClear(REG_SLAVECTL, 0x80, 10000000) != 0 && !(simPeek(REG_SLAVECTL) & 0x40), "fan-out after a trip");
+    seq = simPeek(REG_LOGSEQ) | (simPeek(REG_LOGSEQ + 1) << 8);
+    check(!(readLogEntry(seq - 1, entry) & 0x60) && entry[2] == 4 && entry[3] == 0x01 && entry[4] == 1 &&
+          entry[5] == 0x300 >> 2, "trip in the log after 11 slave commands");
+  }
+  simI2cWriteReg(REG_TRIPCTL, 0);
+  simI2cWriteReg(REG_TRIPSTAT, 0);
+  simI2cWriteReg(REG_POWERCTL, 0x8f);
+  check(waitClear(REG_POWERCTL, 0x80, 10000000) != 0 && (simPeek(REG_POWERCTL) & 0xf) == 0xf, "power on");
+}
+
+//Two complete monitoring scans, so the CALx registers show the current inputs.
+static void waitScans(void){
+  uint8_t seq = simPeek(REG_MONSEQ);
+  unsigned long start = simTime();
+  while ((uint8_t) (simPeek(REG_MONSEQ) - seq) < 2 && simTime() - start < 1000000) simLoop();
+}
+
+static int16_t calRead(uint8_t ch){
+  uint8_t buf[2];
+  simI2cRead(REG_CAL_BASE + 2 * ch, buf, 2);
+  return (int16_t) (buf[0] | (buf[1] << 8));
+}
+
+//Calibrated monitoring values against the conversion in floating point.
+static void benchCalibration(void){
+  const int n = 200;
+  uint8_t buf[6];
+  stat_t s;
+  int i;
+  header("Calibration (CALx, at 100kHz)");
+  simSetAnalog(14, 500);
+  simSetAnalog(139, 563);
+  simSetAnalog(138, simTlvAdc[0]);
+  waitScans();
+  //Within a count: the gain has 8 bits behind the point.
+  check(fabs(calRead(0) - 500 * 1500.0 / 1023) <= 1500.0 / 1023, "CAL0 default: mV at the ADC input");
+  check(fabs(calRead(6) - 563 * 3000.0 / 1023) <= 2, "CAL6 default: VCC in mV");
+  check(fabs(calRead(7) - 3000) <= 1, "CAL7 at 30 degC");
+  check(calRead(5) == 0x3ff, "CAL5 is the FAULT conversion");
+  simSetAnalog(138, simTlvAdc[1]);
+  waitScans();
+  check(fabs(calRead(7) - 8500) <= 1, "CAL7 at 85 degC");
+  check(!(simPeek(REG_CALCTL) & 0x10), "CALCTL: device temperature calibration used");
+
+  //A part whose T30 is far from 0 compared to its slope: CAL7 counts from T30, so its offset is 3000 whatever T30 is.
+  {
+    uint16_t tlv[2] = {simTlvAdc[0], simTlvAdc[1]};
+    simTlvAdc[0] = 800;
+    simTlvAdc[1] = 880;
+    calLoad();
+    simSetAnalog(138, 800);
+    waitScans();
+    check(fabs(calRead(7) - 3000) <= 1, "CAL7 at 30 degC, T30 800");
+    simSetAnalog(138, 880);
+    waitScans();
+    check(fabs(calRead(7) - 8500) <= 1, "CAL7 at 85 degC, T30 800");
+    //No calibration in the TLV: CAL7 in mV, and CALCTL says so.
+    simTlvAdc[0] = 0xFFFF;
+    simTlvAdc[1] = 0xFFFF;
+    calLoad();
+    waitScans();
+    check((simPeek(REG_CALCTL) & 0x10) && fabs(calRead(7) - 880 * 1500.0 / 1023) <= 1500.0 / 1023,
+          "CAL7 without a TLV calibration");
+    simTlvAdc[0] = tlv[0];
+    simTlvAdc[1] = tlv[1];
+    calLoad();
+    check(!(simPeek(REG_CALCTL) & 0x10), "CALCTL bit 4 after the TLV is back");
+  }
+  //Oversampling keeps the result, with more bits behind it.
+  simI2cWriteReg(REG_OSCTL, 2);
+  waitScans();
+  check(fabs(calRead(0) - 500 * 1500.0 / 1023) <= 1500.0 / 1023, "CAL0 oversampled");
+  simI2cWriteReg(REG_OSCTL, 0);
+
+  //A stored calibration of value 0: 2 x conversion - 100, in one write.
+  buf[0] = REG_CALGAIN;
+  buf[1] = 0x00;
+  buf[2] = 0x02;
+  buf[3] = 0x9C;
+  buf[4] = 0xFF;
+  buf[5] = 0xC0;
+  simI2cWrite(buf, 6);
+  check(waitClear(REG_CALCTL, 0x80, 100000) != 0 && simPeek(REG_CALCTL) == 0 && simFram[0x92] == 0xC5, "CALCTL store");
+  waitScans();
+  check(calRead(0) == 900, "CAL0 with stored coefficients");
+  simI2cWriteReg(REG_CALGAIN, 0);
+  simI2cWriteReg(REG_CALCTL, 0x80);
+  check(waitClear(REG_CALCTL, 0x80, 100000) != 0, "CALCTL copy done");
+  simI2cRead(REG_CALGAIN, buf, 4);
+  check(buf[0] == 0x00 && buf[1] == 0x02 && buf[2] == 0x9C && buf[3] == 0xFF, "CALCTL copy");
+
+  memset(&s, 0, sizeof(s));
+  for (i=0;i<n;i++) {
+    uint16_t raw = rand() % 1024;
+    unsigned long t;
+    double h;
+    simSetAnalog(14, raw);
+    t = simTime();
+    h = hostNs();
+    waitScans();
+    s.host += hostNs() - h;
+    statAdd(&s, simTime() - t);
+    check(calRead(0) == 2 * raw - 100, "CAL0 follows the input");
+  }
+  statPrint("two scans to CAL0", &s);
+
+  //Back to the default.
+  simI2cWriteReg(REG_CALCTL, 0xA0);
+  check(waitClear(REG_CALCTL, 0x80, 100000) != 0, "CALCTL default done");
+  simI2cRead(REG_CALGAIN, buf, 4);
+  check(buf[0] == 375 % 256 && buf[1] == 375 / 256 && buf[2] == 0 && buf[3] == 0, "CALCTL default");
+  simSetAnalog(14, 0x100);
+  simSetAnalog(139, 0x100);
+  simSetAnalog(138, 0x100);
+}
+
+//Generation of config record slot (A: 0, B: 1), as stored in FRAM.
+static uint16_t configGeneration(uint8_t slot){
+  return simFram[CONFIG_SIZE * slot + 2] | (simFram[CONFIG_SIZE * slot + 3] << 8);
+}
+
+//The A/B config records. Two stores fill both records, then the newer one is broken: after a reset the older one has
+//to be in use. Without any valid record, the info structure of older firmware is taken over.
+static void benchConfig(void){
+  uint8_t slot;
+  printf("\nConfig records\n");
+  simI2cWriteReg(REG_TIMEOUT, 50);
+  simI2cWriteReg(REG_LINKCTL, 0xC4);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL store");
+  simI2cWriteReg(REG_TIMEOUT, 60);
+  simI2cWriteReg(REG_LINKCTL, 0xC4);
+  check(waitClear(REG_LINKCTL, 0x80, 1000000) != 0, "LINKCTL store");
+  slot = (int16_t) (configGeneration(1) - configGeneration(0)) > 0 ? 1 : 0;
+  check(simFram[0] == 0xC5 && simFram[CONFIG_SIZE] == 0xC5 &&
+        (uint16_t) (configGeneration(slot) - configGeneration(!slot)) == 1, "stores take turns between A and B");
+
+  //One bit of the newer record's TLVs flipped: its CRC no longer holds.
+  simFram[CONFIG_SIZE * slot + 6] ^= 0x01;
+  simReset();
+  check(simPeek(REG_TIMEOUT) == 50, "older record in use after the newer one broke");
+  printf("  record %c broken: TIMEOUT %u from record %c\n", 'A' + slot, simPeek(REG_TIMEOUT), 'A' + !slot);
+
+  //No record at all, and an info structure of older firmware (signature 0x03) at 0x1800.
+  memset(simFram, 0xFF, 2 * CONFIG_SIZE);
+  simFram[0] = 0x03;
+  simFram[1] = 1;
+  simFram[2] = 0x05;
+  simFram[3] = 42;
+  simReset();
+  check(simPeek(REG_POWERDFLT) == 0x05 && simPeek(REG_TIMEOUT) == 100, "info structure of older firmware taken over");
+  check(simFram[0] == 0x03 && simFram[CONFIG_SIZE] == 0xC5, "record B written first, A left alone");
+  printf("  older firmware's info structure: POWERDFLT 0x%02x, record B written\n", simPeek(REG_POWERDFLT));
+}
+
+//The firmware's own latency histograms, in SMCLK cycles.
+static void dumpLatency(void){
+  static const char *pathName[LAT_PATHS] = {"loop", "receive", "slave tx", "slave wait", "slave parse", "monitor",
+                                               "i2c isr"};
+  uint8_t buf[32];
+  uint8_t path;
+  int i;
+  printf("\nFirmware latency histograms (LATCTL), SMCLK cycles; bin x counts 16 * 4^(x-1) up to 16 * 4^x\n");
+  printf("  %-12s %10s %10s  bins\n", "path", "count", "max");
+  for (path=0;path<LAT_PATHS;path++) {
+    simI2cWriteReg(REG_LATCTL, 0x80 | path);
+    simI2cRead(REG_LATCOUNT, buf, 16);
+    simI2cRead(REG_LATCOUNT + 16, buf + 16, 16);
+    printf("  %-12s %10lu %10lu ", pathName[path],
+           buf[0] | (buf[1] << 8) | ((unsigned long) buf[2] << 16) | ((unsigned long) buf[3] << 24),
+           buf[4] | (buf[5] << 8) | ((unsigned long) buf[6] << 16) | ((unsigned long) buf[7] << 24));
+    for (i=0;i<LAT_BINS;i++) printf(" %u", buf[8 + 2*i] | (buf[9 + 2*i] << 8));
+    printf("\n");
+  }
+}
+
+int main(){
+  double start = hostNs();
+  srand(1);
+  simBoot();
+
+  //Power everything on, and wait for the slaves to boot. The attenuator cache is not skipped, so every command goes out.
+  simI2cWriteReg(REG_POWERCTL, 0x8f);
+  check(waitClear(REG_POWERCTL, 0x80, 10000000) != 0 && (simPeek(REG_POWERCTL) & 0xf) == 0xf, "power on");
+  simI2cWriteReg(REG_ATTCTL, 0x1);
+  simRunFor(1500000);
+
+  benchRegisters("100kHz", 10000);
+  benchRegisters("400kHz", 2500);
+  simI2cBit = 10000;
+
+  header("Control dispatch (bit 7 set to bit 7 clear)");
+  benchDispatch("MONCTL conversion", REG_MONCTL, 0x81);
+  benchDispatch("STATCTL copy", REG_STATCTL, 0x81);
+  benchDispatch("POWERCTL, no change", REG_POWERCTL, 0x8f);
+  benchDispatch("LINKCTL apply", REG_LINKCTL, 0x84);
+  benchDispatch("CALCTL copy", REG_CALCTL, 0x80);
+
+  //bin with a rate the UART cannot do stays in text mode.
+  {
+    char cmd[] = "bin";
+    char zero[] = "0";
+    char word[] = "foo";
+    char *argv[2] = {cmd, zero};
+    cmdBinary(2, argv);
+    check(!serialBinary, "bin 0 refused");
+    argv[1] = word;
+    cmdBinary(2, argv);
+    check(!serialBinary, "bin foo refused");
+  }
+  benchBinary();
+
+  benchSlave();
+  benchClock();
+  benchAddress();
+  benchStatistics();
+  benchTrip();
+  benchCalibration();
+  benchConfig();
+  dumpLatency();
+
+  printf("\n%.1f simulated seconds in %.2f host seconds, %d failures\n", simTime() / 1e6, (hostNs() - start) / 1e9,
+         failures);
+  return failures ? 1 : 0;
+}
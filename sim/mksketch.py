@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+# Turns the sketch into C++ the way Energia does: prototypes for all functions go in front of the code.
+# Also writes the register numbers (REG_*) and latency paths (LAT_*) to a header for the benchmark.
+# Usage: mksketch.py sketch.ino sketch.cpp regs.h
+import re
+import sys
+
+ino, cpp, regs = sys.argv[1:4]
+src = open(ino).read()
+
+# Comments out of the way, keeping the line count.
+code = re.sub(r'/\*.*?\*/', lambda m: '\n' * m.group(0).count('\n'), src, flags=re.S)
+code = re.sub(r'//[^\n]*', '', code)
+
+protos = []
+for m in re.finditer(r'^([A-Za-z_][\w \t\*]*?[\s\*])(\w+)\s*\(([^;{}()]*)\)\s*\{', code, re.M):
+    if code[:m.start()].count('{') != code[:m.start()].count('}'):
+        continue
+    ret = ' '.join(m.group(1).split())
+    if ret.split()[0] in ('if', 'else', 'while', 'for', 'switch', 'return', 'typedef', 'struct'):
+        continue
+    protos.append('%s %s(%s);' % (ret, m.group(2), ' '.join(m.group(3).split())))
+
+with open(cpp, 'w') as f:
+    f.write('#include "Energia.h"\n')
+    f.write('\n'.join(protos) + '\n')
+    f.write('#line 1 "%s"\n' % ino)
+    f.write(src)
+
+with open(regs, 'w') as f:
+    f.write('//Generated from %s by mksketch.py.\n' % ino)
+    for line in src.splitlines():
+        if re.match(r'#define (REG|LAT)_\w+\s', line):
+            f.write(line.split('//')[0].rstrip() + '\n')
@@ -0,0 +1,196 @@
+//Simulated MSP430FR5739 peripheral registers, for the host build of arafe_master.ino.
+//Registers are plain variables. sim.cpp looks at the ones with side effects (ADC, TB2, comparator, ports) whenever
+//simulated time moves on.
+#ifndef SIM_MSP430_H
+#define SIM_MSP430_H
+
+#include <stdint.h>
+
+#define SIM_REGS16(X) \
+  X(TB0CTL) X(TB0R) X(TB0CCR0) X(TB0CCTL0) \
+  X(TB1CTL) X(TB1EX0) X(TB1CCTL1) X(TB1CCR0) X(TB1CCR1) X(TB1R) \
+  X(TB2CTL) X(TB2IV) \
+  X(TA0CTL) X(TA0R) X(TA1CTL) X(TA1R) \
+  X(CDCTL0) X(CDCTL1) X(CDCTL2) X(CDCTL3) X(CDINT) \
+  X(CSCTL0) X(CSCTL1) X(CSCTL2) X(CSCTL3) X(CSCTL4) \
+  X(ADC10CTL0) X(ADC10CTL1) X(ADC10CTL2) X(ADC10MCTL0) X(ADC10MEM0) X(ADC10IE) X(ADC10IFG) X(ADC10HI) X(ADC10LO) \
+  X(UCA0BRW) X(UCA0MCTLW) X(UCA0IE) X(UCA1BRW) X(UCA1MCTLW) X(UCA1IE) \
+  X(UCB0CTLW0) X(UCB0I2COA0) X(UCB0I2COA1) X(UCB0I2COA2) X(UCB0ADDMASK) X(UCB0IE) X(UCB0IFG) X(UCB0IV) \
+  X(UCB0RXBUF) X(UCB0TXBUF) X(UCB0ADDRX) X(UCB0STATW) \
+  X(REFCTL0) X(WDTCTL) X(SYSRSTIV)
+
+#define SIM_REGS8(X) \
+  X(P1DIR) X(P1OUT) X(P1IN) X(P1SEL0) X(P1SEL1) \
+  X(P2DIR) X(P2OUT) X(P2IN) X(P2SEL0) X(P2SEL1) \
+  X(P3DIR) X(P3OUT) X(P3IN) X(P3SEL0) X(P3SEL1) \
+  X(P4DIR) X(P4OUT) X(P4IN) X(P4SEL0) X(P4SEL1) \
+  X(PJDIR) X(PJOUT) X(PJIN) X(PJSEL0) X(PJSEL1) \
+  X(CSCTL0_H)
+
+#define SIM_DECLARE16(r) extern volatile uint16_t r;
+#define SIM_DECLARE8(r) extern volatile uint8_t r;
+SIM_REGS16(SIM_DECLARE16)
+SIM_REGS8(SIM_DECLARE8)
+
+//eUSCI_A control word 0. Setting UCSWRST clears the interrupt enables in UCAxIE right away, like on the chip.
+class sim_uca_ctlw0_t {
+public:
+  sim_uca_ctlw0_t(volatile uint16_t &ie) : ie(ie), value(0x0001) {}
+  operator uint16_t() const volatile { return value; }
+  void operator=(uint16_t v) volatile {
+    value = v;
+    if (v & 0x0001) ie = 0;
+  }
+  void operator|=(uint16_t v) volatile { *this = value | v; }
+  void operator&=(uint16_t v) volatile { *this = value & v; }
+private:
+  volatile uint16_t &ie;
+  uint16_t value;
+};
+extern volatile sim_uca_ctlw0_t UCA0CTLW0;
+extern volatile sim_uca_ctlw0_t UCA1CTLW0;
+
+//TB2R counts SMCLK, so it is worked out from the simulated time when it is read.
+#define TB2R sim_tb2r()
+uint16_t sim_tb2r(void);
+
+//Status register
+#define GIE 0x0008
+#define CPUOFF 0x0010
+#define OSCOFF 0x0020
+#define SCG0 0x0040
+#define SCG1 0x0080
+#define LPM0_bits (CPUOFF)
+#define LPM3_bits (SCG1 | SCG0 | CPUOFF)
+#define LPM4_bits (SCG1 | SCG0 | OSCOFF | CPUOFF)
+
+//CS. The password in CSCTL0_H is not checked.
+#define CSKEY 0xA500
+#define DCOFSEL0 0x0002
+#define DCOFSEL1 0x0004
+#define DCOFSEL_0 0x0000
+#define DCOFSEL_1 0x0002
+#define DCOFSEL_2 0x0004
+#define DCOFSEL_3 0x0006
+#define DCORSEL 0x0080
+#define DIVM0 0x0001
+#define DIVM1 0x0002
+#define DIVM2 0x0004
+#define DIVM__1 0x0000
+#define DIVM__8 0x0003
+#define DIVS0 0x0010
+#define DIVS1 0x0020
+#define DIVS2 0x0040
+#define DIVS__1 0x0000
+#define DIVS__8 0x0030
+
+//WDT_A
+#define WDTPW 0x5A00
+#define WDTIS0 0x0001
+#define WDTIS1 0x0002
+#define WDTIS2 0x0004
+#define WDTCNTCL 0x0008
+#define WDTTMSEL 0x0010
+#define WDTIS_5 0x0005
+#define WDTIS_6 0x0006
+
+//eUSCI_A and eUSCI_B
+#define UCSWRST 0x0001
+#define UCOS16 0x0001
+#define UCTR 0x0010
+#define UCSYNC 0x0100
+#define UCMODE_3 0x0600
+#define UCMST 0x0800
+#define UCOAEN 0x0400
+#define UCGCEN 0x8000
+#define UCBBUSY 0x0010
+#define UCRXIE 0x0001
+#define UCTXIE 0x0002
+#define UCRXIE0 0x0001
+#define UCTXIE0 0x0002
+#define UCSTTIE 0x0004
+#define UCSTPIE 0x0008
+#define USCI_I2C_UCSTTIFG 0x0006
+#define USCI_I2C_UCSTPIFG 0x0008
+#define USCI_I2C_UCRXIFG0 0x0016
+#define USCI_I2C_UCTXIFG0 0x0018
+#define USCI_B0_VECTOR 50
+
+//Timer_B
+#define TBIFG 0x0001
+#define TBIE 0x0002
+#define TBCLR 0x0004
+#define MC_0 0x0000
+#define MC_1 0x0010
+#define MC_2 0x0020
+#define TBSSEL_1 0x0100
+#define TBSSEL_2 0x0200
+#define TB2IV_TBIFG 0x000E
+#define TIMER2_B1_VECTOR 38
+
+//ADC10_B
+#define ADC10SC 0x0001
+#define ADC10ENC 0x0002
+#define ADC10ON 0x0010
+#define ADC10SHT_2 0x0200
+#define ADC10SHT_4 0x0400
+#define ADC10SHT_8 0x0800
+#define ADC10BUSY 0x0001
+#define ADC10CONSEQ_0 0x0000
+#define ADC10SSEL_0 0x0000
+#define ADC10SHP 0x0200
+#define ADC10DIV_0 0x0000
+#define ADC10DIV_3 0x0060
+#define ADC10DIV_7 0x00E0
+#define ADC10RES 0x0010
+#define ADC10SREF_1 0x0010
+#define ADC10INCH_MASK 0x000F
+#define ADC10IFG0 0x0001
+#define ADC10INIFG 0x0002
+#define ADC10LOIFG 0x0004
+#define ADC10HIIFG 0x0008
+#define ADC10IE0 0x0001
+#define ADC10_VECTOR 49
+
+//REF
+#define REFON 0x0001
+#define REFVSEL_0 0x0000
+
+//Comparator_D
+#define CDIPSEL_0 0x0000
+#define CDIPSEL_1 0x0001
+#define CDIPSEL_2 0x0002
+#define CDIPSEL_3 0x0003
+#define CDIPSEL_4 0x0004
+#define CDIPSEL_5 0x0005
+#define CDIPSEL_6 0x0006
+#define CDIPSEL_7 0x0007
+#define CDIPSEL_8 0x0008
+#define CDIPSEL_9 0x0009
+#define CDIPSEL_10 0x000A
+#define CDIPSEL_11 0x000B
+#define CDIPSEL_12 0x000C
+#define CDIPSEL_13 0x000D
+#define CDIPSEL_14 0x000E
+#define CDIPSEL_15 0x000F
+#define CDIPEN 0x0080
+#define CDIMSEL_0 0x0000
+#define CDIMSEL_1 0x0100
+#define CDIMSEL_2 0x0200
+#define CDIMSEL_3 0x0300
+#define CDIMSEL_4 0x0400
+#define CDIMSEL_5 0x0500
+#define CDIMSEL_6 0x0600
+#define CDIMSEL_7 0x0700
+#define CDIMSEL_8 0x0800
+#define CDIMSEL_9 0x0900
+#define CDIMSEL_10 0x0A00
+#define CDIMSEL_11 0x0B00
+#define CDIMSEL_12 0x0C00
+#define CDIMSEL_13 0x0D00
+#define CDIMSEL_14 0x0E00
+#define CDIMSEL_15 0x0F00
+#define CDIMEN 0x8000
+#define CDON 0x0400
+
+#endif
@@ -0,0 +1,711 @@
+//Simulated hardware for the host build of arafe_master.ino: time, the Energia core, the peripherals the firmware
+//programs directly, and the slaves on the other end of the slave link.
+//
+//Time only moves when the firmware asks for it (millis(), micros(), TB2R), sleeps, or when the harness runs a pass of
+//loop() or an I2C transaction. Events are handled in time order in between: bytes on the slave link, ADC conversions
+//and TB2 overflows. Interrupt handlers wait while the firmware has interrupts off, like on the chip.
+//
+//The clocks follow CSCTL1 and CSCTL3: MCLK scales the CPU time of loop(), SMCLK drives TB2, the UART baud rates and the
+//watchdog tick that millis() and micros() count. Like Energia, they take that tick to be 512us.
+#include <math.h>
+#include "Energia.h"
+#include "Cmd.h"
+#include "sim.h"
+
+#define SIM_DEFINE16(r) volatile uint16_t r;
+#define SIM_DEFINE8(r) volatile uint8_t r;
+SIM_REGS16(SIM_DEFINE16)
+SIM_REGS8(SIM_DEFINE8)
+volatile sim_uca_ctlw0_t UCA0CTLW0(UCA0IE);
+volatile sim_uca_ctlw0_t UCA1CTLW0(UCA1IE);
+
+//The firmware.
+void setup(void);
+void loop(void);
+void latOverflow(void);
+void monitorInterrupt(void);
+void i2cInterrupt(void);
+extern unsigned char i2cRegisterMap[];
+extern uint8_t i2cRxLength;
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+volatile boolean stay_asleep;
+uint8_t simFram[256];
+uint16_t simTlvAdc[2] = {591, 687};
+
+unsigned long simLoopCost = 20;
+unsigned long simTimerRead = 1;
+unsigned long simAdcTime = 55;
+unsigned long simAdcIsr = 5000;
+unsigned long simI2cBit = 10000;
+unsigned long simI2cIsr = 2500;
+unsigned long simI2cReceive = 1000;
+uint8_t simI2cAddress = 30;
+unsigned long simI2cStretch;
+
+sim_slave_t simSlave[4];
+
+//Board wiring, as in arafe_master.ino: EN[], COMMS_SEL[], and the slave the multiplexer selects for COMMS_SEL.
+static const uint8_t simEnPin[4] = {18, 16, 32, 30};
+static const uint8_t simSelPin[2] = {9, 10};
+static const uint8_t simSelDev[4] = {2, 3, 0, 1};
+//Comparator_D inputs (CDCTL0) the response of every slave comes in on: V- and V+, both enabled.
+static const uint16_t simSlaveComparator[4] = {0x838F, 0x8584, 0x8786, 0x8988};
+//ADC inputs A0-A5 by pin, as analogPort[] in arafe_master.ino. A10 and A11 are pins 138 and 139.
+static const uint8_t simAdcPin[6] = {14, 17, 15, 13, 33, 34};
+
+static unsigned long simNow;
+static bool simGie = true;
+static bool simDebugPort;
+static bool simTrace;
+//Set when loop() has gone to sleep: it is woken by the next millisecond tick, or by wakeup().
+static bool simAsleep;
+static unsigned long simWake;
+//Set while the harness lets loop() sleep: an interrupt handler that wakes the CPU ends the sleep early.
+static bool simSleeping;
+
+//SMCLK cycles since boot, and the time Energia's millis() and micros() see, in us.
+static double simCycles;
+static double simEnergiaUs;
+//TB2: counts SMCLK from simTb2Start, overflows at simTb2Next.
+static double simTb2Start;
+static double simTb2Next;
+
+static uint16_t simAdcValue[16];
+static unsigned long simAdcDone;
+static uint8_t simAdcChannel;
+
+//The slave link: bytes on the wire, in time order. Bytes from the master (dev 0xFF) come back as the echo.
+#define SIM_LINE_MAX 64
+typedef struct sim_byte_t {
+  unsigned long time;
+  uint8_t data;
+  uint8_t dev;
+} sim_byte_t;
+static sim_byte_t simLine[SIM_LINE_MAX];
+static uint8_t simLineLength;
+static unsigned long simLineFree;
+//Bytes received by Serial1, waiting for interrupts to be on.
+static uint8_t simRx[SIM_LINE_MAX];
+static uint8_t simRxLength;
+//The host on the debug port: bytes on their way to the board, in time order, bytes received by Serial and waiting for
+//interrupts to be on, and the bytes the board has sent back.
+#define SIM_DEBUG_MAX 256
+static sim_byte_t simDebugIn[SIM_DEBUG_MAX];
+static uint16_t simDebugInLength;
+static unsigned long simDebugFree;
+static uint8_t simDebugRx[SIM_DEBUG_MAX];
+static uint16_t simDebugRxLength;
+static uint8_t simDebugOut[2 * SIM_DEBUG_MAX];
+static uint16_t simDebugOutLength;
+
+static void simAdvance(unsigned long us);
+
+static unsigned long simByteTime(void){
+  return Serial1.baud ? 10000000UL / Serial1.baud : 1000;
+}
+
+//DCO and divider settings, as in the FR57xx user's guide.
+static double simDco(void){
+  static const double dco[2][4] = {{5.33e6, 6.67e6, 6.67e6, 8e6}, {16e6, 20e6, 20e6, 24e6}};
+  return dco[(CSCTL1 & DCORSEL) ? 1 : 0][(CSCTL1 >> 1) & 0x3];
+}
+
+static double simMclk(void){
+  return simDco() / (1u << (CSCTL3 & 0x7));
+}
+
+static double simSmclk(void){
+  return simDco() / (1u << ((CSCTL3 >> 4) & 0x7));
+}
+
+//CPU time in us of work that takes us at 16MHz MCLK.
+static unsigned long simCpu(unsigned long us){
+  return (unsigned long) ceil(us * 16e6 / simMclk());
+}
+
+//Energia us per real us: the watchdog tick is taken to be 512us.
+static double simEnergiaRate(void){
+  static const double interval[8] = {2147483648.0, 134217728.0, 8388608.0, 524288.0, 32768.0, 8192.0, 512.0, 64.0};
+  return simSmclk() / interval[WDTCTL & 0x7] * 512.0 / 1e6;
+}
+
+//A byte sent or received at a baud rate more than 2% off from what the other end expects is garbled.
+static bool simUartOk(uint8_t port){
+  HardwareSerial &s = port ? Serial1 : Serial;
+  double baud = simUartBaud(port);
+  return !s.baud || fabs(baud - s.baud) < 0.02 * s.baud;
+}
+
+static void simLinePut(unsigned long time, uint8_t data, uint8_t dev){
+  uint8_t i = simLineLength;
+  if (simLineLength == SIM_LINE_MAX) return;
+  while (i && simLine[i - 1].time > time) {
+    simLine[i] = simLine[i - 1];
+    i--;
+  }
+  simLine[i].time = time;
+  simLine[i].data = data;
+  simLine[i].dev = dev;
+  simLineLength++;
+}
+
+static int simSelected(void){
+  return simSelDev[simPin(simSelPin[0]) | (simPin(simSelPin[1]) << 1)];
+}
+
+//A slave has heard a byte from the master.
+static void simSlaveHear(uint8_t dev, uint8_t c){
+  sim_slave_t *s = &simSlave[dev];
+  static const uint8_t header[3] = {'!', 'M', '!'};
+  unsigned long t;
+  uint8_t mode;
+  uint8_t i;
+  if (!s->poweredAt || simNow - s->poweredAt < s->boot) return;
+  if (s->frameLength < 3 && c != header[s->frameLength]) s->frameLength = 0;
+  if (s->frameLength < 3 && c != header[s->frameLength]) return;
+  s->frame[s->frameLength++] = c;
+  if (s->frameLength < 6) return;
+  s->frameLength = 0;
+  if (s->frame[5] != 0xFF) return;
+  s->frames++;
+  mode = s->mode;
+  if (s->faults && --s->faults == 0) s->mode = SIM_SLAVE_OK;
+  if (mode == SIM_SLAVE_SILENT) return;
+  if (s->frame[3] < 8 && s->clamp && s->frame[4] > s->clamp) s->frame[4] = s->clamp;
+  if (mode == SIM_SLAVE_OK && s->frame[3] < 8) s->setting[s->frame[3]] = s->frame[4];
+  s->replies++;
+  t = simNow + s->turnaround;
+  simLinePut(t += simByteTime(), '!', dev);
+  if (mode == SIM_SLAVE_BAD_HEADER) simLinePut(t += simByteTime(), 'X', dev);
+  else simLinePut(t += simByteTime(), s->frame[3] == SIM_SLAVE_READBACK ? 'L' : 'S', dev);
+  simLinePut(t += simByteTime(), '!', dev);
+  if (s->frame[3] == SIM_SLAVE_READBACK) {
+    simLinePut(t += simByteTime(), sizeof(s->setting), dev);
+    for (i=0;i<sizeof(s->setting);i++) simLinePut(t += simByteTime(), s->setting[i], dev);
+  } else {
+    simLinePut(t += simByteTime(), s->frame[4], dev);
+  }
+  simLinePut(t += simByteTime(), mode == SIM_SLAVE_BAD_TRAILER ? 0x00 : 0xFF, dev);
+}
+
+static void simLineDone(const sim_byte_t *b){
+  int dev = simSelected();
+  if (simTrace) printf("%10lu %s %02x  sel %d comparator %s\n", simNow, b->dev == 0xFF ? "master" : "slave ",
+                       b->data, dev, (CDCTL1 & CDON) ? "on" : "off");
+  if (b->dev == 0xFF) {
+    simSlaveHear(dev, b->data);
+  } else if (b->dev != dev || !(CDCTL1 & CDON) || CDCTL0 != simSlaveComparator[dev]) {
+    //Only the selected slave gets through the multiplexer, and only with the comparator on its inputs.
+    return;
+  }
+  if (simRxLength < SIM_LINE_MAX) simRx[simRxLength++] = (b->dev == 0xFF || simUartOk(1)) ? b->data : (uint8_t) ~b->data;
+}
+
+//Interrupts that were waiting for GIE.
+static void simInterrupts(void){
+  uint8_t i;
+  if (!simGie) return;
+  simGie = false;
+  //Without the receive interrupt the bytes are lost: the next one overruns RXBUF.
+  if (UCA1IE & UCRXIE) {
+    for (i=0;i<simRxLength;i++) Serial1.receive(simRx[i]);
+  }
+  simRxLength = 0;
+  if (UCA0IE & UCRXIE) {
+    for (i=0;i<simDebugRxLength;i++) Serial.receive(simDebugRx[i]);
+  }
+  simDebugRxLength = 0;
+  if ((TB2CTL & TBIFG) && (TB2CTL & TBIE)) {
+    TB2CTL &= ~TBIFG;
+    TB2IV = TB2IV_TBIFG;
+    latOverflow();
+    TB2IV = 0;
+  }
+  if ((ADC10IFG & ADC10IFG0) && (ADC10IE & ADC10IE0)) {
+    monitorInterrupt();
+    simAdvance((unsigned long) ceil(simAdcIsr * 16e3 / simMclk()));
+  }
+  simGie = true;
+}
+
+//Peripherals the firmware has just programmed.
+static void simPeripherals(void){
+  uint8_t dev;
+  if (TB2CTL & TBCLR) {
+    TB2CTL &= ~(TBCLR | TBIFG);
+    simTb2Start = simCycles;
+    simTb2Next = simCycles + 0x10000;
+  }
+  if ((ADC10CTL0 & (ADC10ON | ADC10ENC | ADC10SC)) == (ADC10ON | ADC10ENC | ADC10SC)) {
+    ADC10CTL0 &= ~ADC10SC;
+    ADC10CTL1 |= ADC10BUSY;
+    simAdcChannel = ADC10MCTL0 & ADC10INCH_MASK;
+    simAdcDone = simNow + simAdcTime * (((ADC10CTL1 >> 5) & 0x7) + 1);
+  } else if (simAdcDone && !(ADC10CTL0 & ADC10ENC)) {
+    //Clearing ENC stops a single conversion right away.
+    simAdcDone = 0;
+    ADC10CTL1 &= ~ADC10BUSY;
+  }
+  for (dev=0;dev<4;dev++) {
+    if (!simPin(simEnPin[dev])) {
+      simSlave[dev].poweredAt = 0;
+      simSlave[dev].frameLength = 0;
+    } else if (!simSlave[dev].poweredAt) {
+      simSlave[dev].poweredAt = simNow ? simNow : 1;
+    }
+  }
+}
+
+static void simAdvance(unsigned long us){
+  unsigned long until = simNow + us;
+  unsigned long next;
+  for (;;) {
+    simPeripherals();
+    next = until;
+    if (simLineLength && simLine[0].time < next) next = simLine[0].time;
+    if (simDebugInLength && simDebugIn[0].time < next) next = simDebugIn[0].time;
+    if (simAdcDone && simAdcDone < next) next = simAdcDone;
+    if ((TB2CTL & MC_2) && simNow + (unsigned long) ceil((simTb2Next - simCycles) * 1e6 / simSmclk()) < next) {
+      next = simNow + (unsigned long) ceil((simTb2Next - simCycles) * 1e6 / simSmclk());
+    }
+    if (next > simNow) {
+      simCycles += (next - simNow) * simSmclk() / 1e6;
+      simEnergiaUs += (next - simNow) * simEnergiaRate();
+      simNow = next;
+    }
+    while (simLineLength && simLine[0].time <= simNow) {
+      sim_byte_t b = simLine[0];
+      simLineLength--;
+      memmove(simLine, simLine + 1, simLineLength * sizeof(sim_byte_t));
+      simLineDone(&b);
+    }
+    while (simDebugInLength && simDebugIn[0].time <= simNow) {
+      uint8_t c = simDebugIn[0].data;
+      if (simDebugRxLength < SIM_DEBUG_MAX) simDebugRx[simDebugRxLength++] = simUartOk(0) ? c : (uint8_t) ~c;
+      simDebugInLength--;
+      memmove(simDebugIn, simDebugIn + 1, simDebugInLength * sizeof(sim_byte_t));
+    }
+    if (simAdcDone && simAdcDone <= simNow) {
+      simAdcDone = 0;
+      ADC10CTL1 &= ~ADC10BUSY;
+      ADC10MEM0 = simAdcValue[simAdcChannel];
+      ADC10IFG |= ADC10IFG0;
+      if (ADC10MEM0 > ADC10HI) ADC10IFG |= ADC10HIIFG;
+      if (ADC10MEM0 < ADC10LO) ADC10IFG |= ADC10LOIFG;
+    }
+    if ((TB2CTL & MC_2) && simTb2Next <= simCycles) {
+      simTb2Next += 0x10000;
+      TB2CTL |= TBIFG;
+    }
+    simInterrupts();
+    if (simNow >= until || (simSleeping && !simAsleep && simGie)) return;
+  }
+}
+
+//Energia core
+
+uint16_t sim_tb2r(void){
+  simAdvance(simCpu(simTimerRead));
+  if (!(TB2CTL & MC_2)) return 0;
+  return (uint16_t) (unsigned long) (simCycles - simTb2Start);
+}
+
+void sim_set_gie(bool on){
+  simGie = on;
+  simInterrupts();
+}
+
+uint16_t sim_get_sr(void){
+  return simGie ? GIE : 0;
+}
+
+//LPM0: the watchdog tick behind millis() wakes the CPU every millisecond, or wakeup() from an interrupt handler.
+//The time asleep is taken before the next pass of loop(), so that an I2C transaction can come in meanwhile.
+void sim_bis_sr(uint16_t bits){
+  if (bits & GIE) sim_set_gie(true);
+  if ((bits & CPUOFF) && stay_asleep) {
+    simAsleep = true;
+    simWake = simNow + (unsigned long) ceil((1000 - fmod(simEnergiaUs, 1000)) / simEnergiaRate());
+  }
+}
+
+unsigned long millis(void){
+  simAdvance(simCpu(simTimerRead));
+  return (unsigned long) (simEnergiaUs / 1000);
+}
+
+unsigned long micros(void){
+  simAdvance(simCpu(simTimerRead));
+  return (unsigned long) simEnergiaUs;
+}
+
+void delay(uint32_t ms){
+  simAdvance((unsigned long) ceil(1000.0 * ms / simEnergiaRate()));
+}
+
+void delayMicroseconds(unsigned int us){
+  simAdvance(us);
+}
+
+//Returning from an interrupt handler into active mode. The handlers only do this once wakeup() has cleared stay_asleep,
+//so wakeup() already ends the sleep. The sketch clears stay_asleep itself when sim_bis_sr() returns, which is long
+//before the harness lets the time asleep pass.
+void sim_bic_sr_on_exit(uint16_t){
+}
+
+void wakeup(void){
+  stay_asleep = false;
+  simAsleep = false;
+}
+
+//Pins 1-40 are P1.0-P4.7 and PJ.0-PJ.7, eight to a port.
+uint8_t digitalPinToPort(uint8_t pin){
+  return (pin >= 1 && pin <= 40) ? 1 + (pin - 1) / 8 : 0;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin){
+  return 1u << ((pin - 1) % 8);
+}
+
+uint8_t digitalPinToADCIn(uint8_t pin){
+  uint8_t i;
+  for (i=0;i<6;i++) if (simAdcPin[i] == pin) return i;
+  return NOT_ON_ADC;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port){
+  static volatile uint8_t *const reg[] = {0, &P1OUT, &P2OUT, &P3OUT, &P4OUT, &PJOUT};
+  return port <= 5 ? reg[port] : 0;
+}
+
+volatile uint8_t *portDirRegister(uint8_t port){
+  static volatile uint8_t *const reg[] = {0, &P1DIR, &P2DIR, &P3DIR, &P4DIR, &PJDIR};
+  return port <= 5 ? reg[port] : 0;
+}
+
+volatile uint8_t *portInputRegister(uint8_t port){
+  static volatile uint8_t *const reg[] = {0, &P1IN, &P2IN, &P3IN, &P4IN, &PJIN};
+  return port <= 5 ? reg[port] : 0;
+}
+
+void pinMode(uint8_t pin, uint8_t mode){
+  uint8_t port = digitalPinToPort(pin);
+  if (!port) return;
+  if (mode == OUTPUT) *portDirRegister(port) |= digitalPinToBitMask(pin);
+  else *portDirRegister(port) &= ~digitalPinToBitMask(pin);
+}
+
+void digitalWrite(uint8_t pin, uint8_t val){
+  uint8_t port = digitalPinToPort(pin);
+  if (!port) return;
+  if (val) *portOutputRegister(port) |= digitalPinToBitMask(pin);
+  else *portOutputRegister(port) &= ~digitalPinToBitMask(pin);
+}
+
+uint8_t digitalRead(uint8_t pin){
+  return simPin(pin);
+}
+
+size_t Print::write(const uint8_t *buf, size_t len){
+  size_t n = 0;
+  while (len--) n += write(*buf++);
+  return n;
+}
+
+size_t Print::print(long v, int base){
+  if (v < 0 && base == DEC) {
+    size_t n = print('-');
+    return n + print((unsigned long) -v, base);
+  }
+  return print((unsigned long) v, base);
+}
+
+size_t Print::print(unsigned long v, int base){
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", v);
+  return print(buf);
+}
+
+//Energia's begin(): the dividers for a 16MHz SMCLK, with oversampling, and the receive interrupt on.
+void HardwareSerial::begin(unsigned long b){
+  unsigned long div = b ? 16000000UL / b : 0;
+  volatile sim_uca_ctlw0_t &ctl = port ? UCA1CTLW0 : UCA0CTLW0;
+  volatile uint16_t &ie = port ? UCA1IE : UCA0IE;
+  baud = b;
+  head = tail = 0;
+  ctl |= UCSWRST;
+  (port ? UCA1BRW : UCA0BRW) = div / 16;
+  (port ? UCA1MCTLW : UCA0MCTLW) = UCOS16 | ((div % 16) << 4);
+  ctl &= ~UCSWRST;
+  ie |= UCRXIE;
+}
+
+int HardwareSerial::read(void){
+  int c;
+  if (head == tail) return -1;
+  c = rx[tail];
+  tail = (tail + 1) % SERIAL_BUFFER_SIZE;
+  return c;
+}
+
+void HardwareSerial::receive(uint8_t c){
+  uint8_t next = (head + 1) % SERIAL_BUFFER_SIZE;
+  if (next == tail) return;
+  rx[head] = c;
+  head = next;
+}
+
+//Serial1 is the slave link: the byte goes out after the ones before it. Serial is the debug port.
+size_t HardwareSerial::write(uint8_t c){
+  if (port == 1) {
+    if (simLineFree < simNow) simLineFree = simNow;
+    simLineFree += simByteTime();
+    simLinePut(simLineFree, simUartOk(1) ? c : (uint8_t) ~c, 0xFF);
+  } else {
+    if (simDebugOutLength < sizeof(simDebugOut)) simDebugOut[simDebugOutLength++] = c;
+    if (simDebugPort) putchar(c);
+  }
+  return 1;
+}
+
+void cmdInit(uint32_t speed){
+  Serial.begin(speed);
+}
+
+void cmdPoll(void){
+}
+
+void cmdAdd(const char *, int (*)(int, char **)){
+}
+
+//Harness
+
+void simBoot(void){
+  uint8_t dev;
+  simDebugPort = getenv("SIM_SERIAL") != 0;
+  simTrace = getenv("SIM_TRACE") != 0;
+  memset(simFram, 0xFF, sizeof(simFram));
+  for (dev=0;dev<16;dev++) simAdcValue[dev] = 0x100;
+  //!FAULT is active low.
+  simSetAnalog(simAdcPin[5], 0x3ff);
+  simReset();
+}
+
+void simReset(void){
+  uint8_t dev;
+  //Energia's clocks: DCO 16MHz, no dividers, and the watchdog interval timer at SMCLK / 8192.
+  CSCTL1 = DCORSEL;
+  CSCTL3 = DIVS__1 | DIVM__1;
+  WDTCTL = 0x6900 | WDTTMSEL | WDTIS_5;
+  for (dev=0;dev<4;dev++) {
+    memset(&simSlave[dev], 0, sizeof(sim_slave_t));
+    memset(simSlave[dev].setting, 0xFF, sizeof(simSlave[dev].setting));
+    simSlave[dev].turnaround = 2000;
+    simSlave[dev].boot = 100000;
+  }
+  setup();
+}
+
+//Sleep until the millisecond tick, or until an interrupt handler wakes the CPU, but not beyond end.
+static void simSleep(unsigned long end){
+  if (!simAsleep || simWake <= simNow) return;
+  simSleeping = true;
+  simAdvance((simWake < end ? simWake : end) - simNow);
+  simSleeping = false;
+}
+
+void simLoop(void){
+  simSleep(simWake);
+  simAsleep = false;
+  simAdvance(simCpu(simLoopCost));
+  loop();
+}
+
+unsigned long simTime(void){
+  return simNow;
+}
+
+void simRunFor(unsigned long us){
+  unsigned long end = simNow + us;
+  for (;;) {
+    simSleep(end);
+    if (simNow >= end) return;
+    simLoop();
+  }
+}
+
+//I2C master, talking to eUSCI_B0. Bytes take simI2cBit per bit. The slave holds SCL low (clock stretching) until the
+//handler of the interrupt before has had its CPU time: the first byte of a read waits for the start condition handler,
+//every other byte has the one before it to be handled in.
+static unsigned long simI2cRest;
+//Part of the last handler's CPU time that has passed already: what the handler itself spent on timer reads.
+static unsigned long simI2cSpent;
+
+static void simI2cWait(unsigned long ns){
+  simI2cRest += ns;
+  simAdvance(simI2cRest / 1000);
+  simI2cRest %= 1000;
+}
+
+//Give the slave busy ns after a byte of window ns has started.
+static void simI2cByte(unsigned long busy, unsigned long window){
+  unsigned long wait = busy > window ? busy : window;
+  if (busy > window) simI2cStretch += busy - window;
+  simI2cWait(wait - (simI2cSpent < wait ? simI2cSpent : wait));
+  simI2cSpent = 0;
+}
+
+//Interrupt handlers run with interrupts off. Returns the CPU time of the handler in ns: simI2cIsr, simI2cReceive for
+//every byte it hands to receiveEvent(), and the time that passed while it ran.
+static unsigned long simI2cInterrupt(uint16_t iv){
+  unsigned long start = simNow;
+  unsigned long work = simI2cIsr;
+  if (iv == USCI_I2C_UCSTTIFG || iv == USCI_I2C_UCSTPIFG) work += i2cRxLength * simI2cReceive;
+  simGie = false;
+  UCB0IV = iv;
+  i2cInterrupt();
+  UCB0IV = 0;
+  sim_set_gie(true);
+  simI2cSpent = (simNow - start) * 1000;
+  return (unsigned long) ceil(work * 16e6 / simMclk()) + simI2cSpent;
+}
+
+//Start (or repeated start) condition and address: the own address (I2COA0), the general call if I2COA0 takes it, or
+//I2COA1. Returns false for a NACK, and the start condition handler's CPU time in busy otherwise.
+static bool simI2cStart(bool read, unsigned long *busy){
+  bool own = (UCB0I2COA0 & UCOAEN) && (UCB0I2COA0 & 0x7f) == simI2cAddress;
+  bool group = (UCB0I2COA1 & UCOAEN) && (UCB0I2COA1 & 0x7f) == simI2cAddress;
+  bool call = (UCB0I2COA0 & UCGCEN) && simI2cAddress == 0 && !read;
+  simI2cSpent = 0;
+  //The bus is busy from the start condition on, whoever it is for.
+  UCB0STATW |= UCBBUSY;
+  simI2cWait(10 * simI2cBit);
+  if ((UCB0CTLW0 & UCSWRST) || !(own || group || call)) {
+    simI2cWait(simI2cBit);
+    UCB0STATW &= ~UCBBUSY;
+    return false;
+  }
+  UCB0ADDRX = simI2cAddress;
+  if (read) UCB0CTLW0 |= UCTR;
+  else UCB0CTLW0 &= ~UCTR;
+  *busy = simI2cInterrupt(USCI_I2C_UCSTTIFG);
+  return true;
+}
+
+static unsigned long simI2cSend(const uint8_t *buf, uint8_t len, unsigned long busy){
+  uint8_t i;
+  for (i=0;i<len;i++) {
+    simI2cByte(busy, 9 * simI2cBit);
+    UCB0RXBUF = buf[i];
+    busy = simI2cInterrupt(USCI_I2C_UCRXIFG0);
+  }
+  return busy;
+}
+
+static void simI2cStop(unsigned long busy){
+  simI2cByte(busy, simI2cBit);
+  UCB0STATW &= ~UCBBUSY;
+  simI2cInterrupt(USCI_I2C_UCSTPIFG);
+}
+
+void simI2cWrite(const uint8_t *buf, uint8_t len){
+  unsigned long busy;
+  if (!simI2cStart(false, &busy)) return;
+  simI2cStop(simI2cSend(buf, len, busy));
+}
+
+void simI2cWriteReg(uint8_t reg, uint8_t val){
+  uint8_t buf[2] = {reg, val};
+  simI2cWrite(buf, 2);
+}
+
+//The pointer write, then a repeated start for the read.
+uint8_t simI2cRead(uint8_t reg, uint8_t *buf, uint8_t len){
+  unsigned long busy;
+  uint8_t i;
+  if (!simI2cStart(false, &busy)) return 0;
+  busy = simI2cSend(&reg, 1, busy);
+  simI2cByte(busy, simI2cBit);
+  simI2cStart(true, &busy);
+  //The first byte waits for TXBUF.
+  simI2cByte(busy, 0);
+  for (i=0;i<len;i++) {
+    buf[i] = UCB0TXBUF;
+    busy = simI2cInterrupt(USCI_I2C_UCTXIFG0);
+    //The master NACKs the last byte, and the one the handler has put into TXBUF for it is dropped.
+    simI2cByte(i + 1 < len ? busy : 0, 9 * simI2cBit);
+  }
+  simI2cStop(0);
+  return len;
+}
+
+uint8_t simI2cReadReg(uint8_t reg){
+  uint8_t val;
+  simI2cRead(reg, &val, 1);
+  return val;
+}
+
+uint8_t simPeek(uint8_t reg){
+  return i2cRegisterMap[reg];
+}
+
+void simSetAnalog(uint8_t pin, uint16_t val){
+  uint8_t channel = pin > 127 ? pin - 128 : digitalPinToADCIn(pin);
+  if (channel < 16) simAdcValue[channel] = val & 0x3ff;
+}
+
+uint8_t simPin(uint8_t pin){
+  uint8_t port = digitalPinToPort(pin);
+  if (!port) return 0;
+  return (*portOutputRegister(port) & digitalPinToBitMask(pin)) ? 1 : 0;
+}
+
+bool simSlavePowered(uint8_t dev){
+  return simSlave[dev].poweredAt != 0;
+}
+
+void simSlaveFault(uint8_t dev, uint8_t mode, unsigned long count){
+  simSlave[dev].mode = mode;
+  simSlave[dev].faults = count;
+}
+
+//The baud rate the dividers of UCA0 (port 0) or UCA1 make at the SMCLK in use. UCBRSx adds a fraction of a clock per bit.
+double simUartBaud(uint8_t port){
+  uint16_t br = port ? UCA1BRW : UCA0BRW;
+  uint16_t mctl = port ? UCA1MCTLW : UCA0MCTLW;
+  double div = (mctl & UCOS16) ? 16.0 * br + ((mctl >> 4) & 0xF) : br;
+  uint8_t brs = mctl >> 8;
+  uint8_t i;
+  for (i=0;i<8;i++) if (brs & (1u << i)) div += 0.125;
+  return div ? simSmclk() / div : 0;
+}
+
+//The host sends at the rate the debug port was opened with, Serial.begin()'s.
+void simDebugSend(const uint8_t *buf, uint16_t len){
+  unsigned long byteTime = Serial.baud ? 10000000UL / Serial.baud : 1000;
+  uint16_t i;
+  if (simDebugFree < simNow) simDebugFree = simNow;
+  for (i=0;i<len && simDebugInLength<SIM_DEBUG_MAX;i++) {
+    simDebugFree += byteTime;
+    simDebugIn[simDebugInLength].time = simDebugFree;
+    simDebugIn[simDebugInLength].data = buf[i];
+    simDebugIn[simDebugInLength].dev = 0xFF;
+    simDebugInLength++;
+  }
+}
+
+uint16_t simDebugReceive(uint8_t *buf, uint16_t max){
+  uint16_t len = simDebugOutLength < max ? simDebugOutLength : max;
+  memcpy(buf, simDebugOut, len);
+  simDebugOutLength -= len;
+  memmove(simDebugOut, simDebugOut + len, simDebugOutLength);
+  return len;
+}
+
+//TB1 toggles the CARRIER pin at every period in up mode.
+double simCarrierHz(void){
+  if (!(TB1CTL & MC_1) || !TB1CCR0) return 0;
+  return simSmclk() / (2.0 * (TB1CCR0 + 1));
+}
@@ -0,0 +1,86 @@
+//Host simulation of the ARAFE master board: drives arafe_master.ino's setup() and loop() against simulated time,
+//an I2C master, the ADC inputs and four scripted slaves on the slave link.
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+//What a slave does with the frames it gets, see simSlaveFault().
+#define SIM_SLAVE_OK 0
+#define SIM_SLAVE_SILENT 1            //< no reply at all
+#define SIM_SLAVE_BAD_HEADER 2        //< reply starts with !X! instead of !S!
+#define SIM_SLAVE_BAD_TRAILER 3       //< reply ends with 0x00 instead of 0xFF
+
+//Command a slave answers with a long response ("!L!", length, data, 0xFF): its attenuator settings 0-7.
+#define SIM_SLAVE_READBACK 0x20
+
+typedef struct sim_slave_t {
+  uint8_t mode;                       //< SIM_SLAVE_*
+  unsigned long faults;               //< frames mode still applies to, 0: all of them
+  unsigned long turnaround;           //< us from the end of a frame to the start of the reply
+  unsigned long boot;                 //< us from power on until the slave listens
+  unsigned long poweredAt;            //< when EN went high, 0 while off
+  uint8_t frame[6];
+  uint8_t frameLength;
+  unsigned long frames;               //< complete !M! frames received
+  unsigned long replies;              //< replies sent, good or not
+  uint8_t setting[8];                 //< last setting of attenuator commands 0-7, 0xFF if never set
+  uint8_t clamp;                      //< if not 0: attenuator arguments above it are set and acknowledged as clamp
+} sim_slave_t;
+extern sim_slave_t simSlave[4];
+
+//Model constants, in us unless noted. They can be changed before simBoot().
+extern unsigned long simLoopCost;     //< CPU time of one pass of loop() that does not sleep, at 16MHz MCLK
+extern unsigned long simTimerRead;    //< CPU time of reading millis(), micros() or TB2R, at 16MHz MCLK
+extern unsigned long simAdcTime;      //< sample and conversion time of the ADC, at ADC clock divider 1
+extern unsigned long simAdcIsr;       //< CPU time of the ADC interrupt handler in ns, at 16MHz MCLK, besides its timer
+                                      //< reads
+extern unsigned long simI2cBit;       //< one I2C bit in ns, 10000 at 100kHz, 2500 at 400kHz
+extern unsigned long simI2cIsr;       //< CPU time of an I2C interrupt handler in ns, at 16MHz MCLK, besides its timer
+                                      //< reads (simTimerRead each)
+extern unsigned long simI2cReceive;   //< more CPU time in ns of a start or stop condition handler, for every byte it
+                                      //< hands to receiveEvent(), at 16MHz MCLK
+extern uint8_t simI2cAddress;         //< 7 bit address the I2C master talks to, 30 by default, 0: general call
+//The temperature sensor conversions of the device TLV, at 30 and 85 degC with the 1.5V reference.
+extern uint16_t simTlvAdc[2];
+//Time the slave has held SCL low so far, in ns.
+extern unsigned long simI2cStretch;
+
+void simBoot(void);
+//Reset the board: the slaves lose power and setup() runs again, with FRAM as it is. The sketch's RAM does not start
+//over like on the chip, so this only shows what setup() takes from FRAM.
+void simReset(void);
+//One pass of loop(), after the CPU has woken up if loop() went to sleep last time.
+void simLoop(void);
+unsigned long simTime(void);
+//Let time pass, running loop() whenever the CPU is awake.
+void simRunFor(unsigned long us);
+
+//I2C master. Transactions take their bus time, so loop() does not run meanwhile. A write or read to an address nobody
+//has is NACKed, and the read returns 0.
+void simI2cWrite(const uint8_t *buf, uint8_t len);
+void simI2cWriteReg(uint8_t reg, uint8_t val);
+uint8_t simI2cRead(uint8_t reg, uint8_t *buf, uint8_t len);
+uint8_t simI2cReadReg(uint8_t reg);
+//A register as the firmware has it right now, without a bus transaction.
+uint8_t simPeek(uint8_t reg);
+
+//Inputs and outputs, by Energia pin number.
+void simSetAnalog(uint8_t pin, uint16_t val);
+uint8_t simPin(uint8_t pin);
+bool simSlavePowered(uint8_t dev);
+
+//What the clocks make of the UART dividers of port 0 (debug port) or 1 (slave link), and of the CARRIER timer.
+double simUartBaud(uint8_t port);
+double simCarrierHz(void);
+
+//The host on the debug port. simDebugSend() queues bytes to the board, one after the other at the rate of the last
+//Serial.begin(). They are lost while UCA0 has its receive interrupt off. simDebugReceive() takes up to max of the bytes
+//the board has written to the debug port so far, and returns how many.
+void simDebugSend(const uint8_t *buf, uint16_t len);
+uint16_t simDebugReceive(uint8_t *buf, uint16_t max);
+
+//The next count frames to slave dev get mode instead of a good reply. 0 applies it for good.
+void simSlaveFault(uint8_t dev, uint8_t mode, unsigned long count);
+
+#endif